@@ -0,0 +1,333 @@
+/* cache.c
+ *
+ * This file is part of foomatic-rip.
+ *
+ * Foomatic-rip is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Foomatic-rip is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "foomaticrip.h"
+#include "util.h"
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+
+/* Temporary files of interrupted jobs are removed after this many seconds */
+#define CACHE_TMP_MAX_AGE (24 * 60 * 60)
+
+
+/*
+ * SHA-256 (FIPS 180-4)
+ */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i +1] << 16 |
+               (uint32_t)p[4*i +2] << 8 | p[4*i +3];
+    for (i = 16; i < 64; i++)
+        w[i] = w[i -16] + (ROR(w[i -15], 7) ^ ROR(w[i -15], 18) ^ (w[i -15] >> 3)) +
+               w[i -7] + (ROR(w[i -2], 17) ^ ROR(w[i -2], 19) ^ (w[i -2] >> 10));
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+             sha256_k[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void cache_key_init(cache_key_t *key)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(key->state, init, sizeof(init));
+    key->len = 0;
+}
+
+void cache_key_add(cache_key_t *key, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used = key->len % 64, n;
+
+    key->len += len;
+    if (used) {
+        n = len < 64 - used ? len : 64 - used;
+        memcpy(&key->buf[used], p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        sha256_block(key->state, key->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(key->state, p);
+    memcpy(key->buf, p, len);
+}
+
+int cache_key_add_file(cache_key_t *key, const char *filename)
+{
+    char buf[65536];
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return 0;
+        }
+        cache_key_add(key, buf, n);
+    }
+    close(fd);
+    return 1;
+}
+
+void cache_key_final(cache_key_t *key, char hex[65])
+{
+    unsigned char pad[72] = { 0x80 };
+    uint64_t bits = key->len * 8;
+    size_t padlen = (key->len % 64 < 56 ? 56 : 120) - key->len % 64;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        pad[padlen + i] = bits >> (56 - 8 * i);
+    cache_key_add(key, pad, padlen + 8);
+
+    for (i = 0; i < 32; i++)
+        sprintf(&hex[2 * i], "%02x", (key->state[i / 4] >> (24 - 8 * (i % 4))) & 0xff);
+}
+
+
+/*
+ * Entries
+ */
+
+int cache_enabled()
+{
+    return !isempty(cache_dir) && cache_size > 0;
+}
+
+/* The kinds of entries, the names which entry_name() makes from them are
+   the only files which cache_evict() removes */
+static const char *entry_kinds[] = { "ps", "out", NULL };
+
+/* 0 if the name does not fit */
+static int entry_name(char *name, const char *kind, const char *hex)
+{
+    int n = snprintf(name, 4096, "%s/%s-%s", cache_dir, kind, hex);
+
+    if (n < 0 || n >= 4096) {
+        _log("Cache directory name too long: %s\n", cache_dir);
+        return 0;
+    }
+    return 1;
+}
+
+int cache_lookup(const char *kind, const char *hex)
+{
+    char name[4096];
+    int fd;
+
+    if (!cache_enabled())
+        return -1;
+
+    if (!entry_name(name, kind, hex) ||
+        (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    /* The modification time tells which entries were used least recently */
+    utimensat(AT_FDCWD, name, NULL, 0);
+    _log("Found %s in the cache\n", name);
+    return fd;
+}
+
+cache_entry_t * cache_store_begin(const char *kind, const char *hex)
+{
+    cache_entry_t *entry;
+
+    if (!cache_enabled())
+        return NULL;
+
+    if (!(entry = malloc(sizeof(cache_entry_t)))) {
+        _log("Could not allocate a cache entry\n");
+        return NULL;
+    }
+    if (!entry_name(entry->name, kind, hex) ||
+        snprintf(entry->tmpname, 4096, "%s/.tmp-XXXXXX", cache_dir) >= 4096) {
+        free(entry);
+        return NULL;
+    }
+    entry->failed = 0;
+    if ((entry->fd = mkstemp(entry->tmpname)) < 0) {
+        _log("Could not create cache entry in %s: %s\n", cache_dir, strerror(errno));
+        free(entry);
+        return NULL;
+    }
+    fcntl(entry->fd, F_SETFD, FD_CLOEXEC);
+    return entry;
+}
+
+typedef struct cache_file {
+    char name[256];
+    off_t size;
+    time_t mtime;
+} cache_file_t;
+
+static int cmp_mtime(const void *a, const void *b)
+{
+    time_t ta = ((const cache_file_t *)a)->mtime;
+    time_t tb = ((const cache_file_t *)b)->mtime;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Whether 'name' is one which entry_name() makes: kind, '-' and the 64
+   hex digits of a digest */
+static int is_entry_name(const char *name)
+{
+    const char *p;
+    int i;
+
+    for (i = 0; entry_kinds[i]; i++) {
+        if (!startswith(name, entry_kinds[i]) || name[strlen(entry_kinds[i])] != '-')
+            continue;
+        p = name + strlen(entry_kinds[i]) + 1;
+        if (strlen(p) == 64 && strspn(p, "0123456789abcdef") == 64)
+            return 1;
+    }
+    return 0;
+}
+
+/* Remove the least recently used entries until they fit into cache_size,
+   files which are no entries are left alone */
+static void cache_evict()
+{
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+    cache_file_t *files = NULL, *more;
+    size_t count = 0, alloc = 0, i;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+
+    if (!(dir = opendir(cache_dir)))
+        return;
+
+    while ((ent = readdir(dir))) {
+        if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+
+        if (ent->d_name[0] == '.') {
+            if (startswith(ent->d_name, ".tmp-") && now - st.st_mtime > CACHE_TMP_MAX_AGE)
+                unlinkat(dirfd(dir), ent->d_name, 0);
+            continue;
+        }
+        if (!is_entry_name(ent->d_name))
+            continue;
+
+        if (count == alloc) {
+            alloc = alloc ? 2 * alloc : 64;
+            if (!(more = realloc(files, alloc * sizeof(cache_file_t)))) {
+                _log("Could not allocate the list of cache entries\n");
+                closedir(dir);
+                free(files);
+                return;
+            }
+            files = more;
+        }
+        strlcpy(files[count].name, ent->d_name, 256);
+        files[count].size = st.st_size;
+        files[count].mtime = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > cache_size) {
+        qsort(files, count, sizeof(cache_file_t), cmp_mtime);
+        for (i = 0; i < count && total > cache_size; i++) {
+            _log("Removing %s from the cache\n", files[i].name);
+            if (unlinkat(dirfd(dir), files[i].name, 0) == 0 || errno == ENOENT)
+                total -= files[i].size;
+        }
+    }
+
+    closedir(dir);
+    free(files);
+}
+
+int cache_store_commit(cache_entry_t *entry)
+{
+    int ok = 1;
+
+    if (fsync(entry->fd) != 0 || close(entry->fd) != 0 ||
+        rename(entry->tmpname, entry->name) != 0) {
+        _log("Could not store %s: %s\n", entry->name, strerror(errno));
+        unlink(entry->tmpname);
+        ok = 0;
+    }
+    else
+        _log("Stored %s in the cache\n", entry->name);
+
+    free(entry);
+    cache_evict();
+    return ok;
+}
+
+void cache_store_abort(cache_entry_t *entry)
+{
+    close(entry->fd);
+    unlink(entry->tmpname);
+    free(entry);
+}
+
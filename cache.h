@@ -0,0 +1,66 @@
+/* cache.h
+ *
+ * This file is part of foomatic-rip.
+ *
+ * Foomatic-rip is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Foomatic-rip is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef cache_h
+#define cache_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* On-disk cache for the results of expensive conversions, in the directory
+   "cache_dir" of filter.conf. Entries are named by their kind and the
+   SHA-256 digest of everything their contents depend on. When the entries
+   take more than "cache_size" bytes, the least recently used ones are
+   removed. */
+
+typedef struct cache_key {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char buf[64];
+} cache_key_t;
+
+void cache_key_init(cache_key_t *key);
+void cache_key_add(cache_key_t *key, const void *data, size_t len);
+/* Add the contents of the file, 0 on error */
+int cache_key_add_file(cache_key_t *key, const char *filename);
+/* The digest as hex string */
+void cache_key_final(cache_key_t *key, char hex[65]);
+
+int cache_enabled();
+
+/* Open the entry for reading and mark it as used, -1 if it is not there */
+int cache_lookup(const char *kind, const char *hex);
+
+/* A new entry is written into a temporary file in the cache directory,
+   it gets its name when it is complete */
+typedef struct cache_entry {
+    int fd;
+    int failed;             /* writing into it went wrong */
+    char tmpname[4096];
+    char name[4096];
+} cache_entry_t;
+
+cache_entry_t * cache_store_begin(const char *kind, const char *hex);
+int cache_store_commit(cache_entry_t *entry);
+void cache_store_abort(cache_entry_t *entry);
+
+#endif
+
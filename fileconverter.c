@@ -26,10 +26,12 @@
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "foomaticrip.h"
 #include "options.h"
 #include "process.h"
+#include "pump.h"
 
 
 /*
@@ -119,95 +121,6 @@ char * fileconverter_from_template(const char *fileconverter,
     return res;
 }
 
-int exec_kid2(FILE *in, FILE *out, void *user_arg)
-{
-    int n;
-    const char *alreadyread = (const char *)user_arg;
-    char tmp[1024];
-
-    /* child, first part of the pipe, reading in the data from standard input
-     * and stuffing it into the file converter after putting in the already
-     * read data (in alreadyread) */
-
-    _log("kid2: writing alreadyread\n");
-
-    /* At first pass the data which we already read to the filter */
-    fwrite(alreadyread, 1, strlen(alreadyread), out);
-
-    _log("kid2: Then read the rest from standard input\n");
-    /* Then read the rest from standard input */
-    while ((n = fread(tmp, 1, 1024, stdin)) > 0)
-        fwrite(tmp, 1, n, out);
-
-    _log("kid2: Close out and stdin\n");
-    fclose(out);
-    fclose(stdin);
-
-    _log("kid2 finished\n");
-    return EXIT_PRINTED;
-}
-
-typedef struct {
-    const char *fileconv;
-    const char *alreadyread;
-} kid1_userdata_t;
-
-int exec_kid1(FILE *in, FILE *out, void *user_arg)
-{
-    int kid2;
-    FILE *kid2out;
-    int status;
-    const char *fileconv = ((kid1_userdata_t *)user_arg)->fileconv;
-    const char *alreadyread = ((kid1_userdata_t *)user_arg)->alreadyread;
-
-    kid2 = start_process("kid2", exec_kid2, (void *)alreadyread, NULL, &kid2out);
-    if (kid2 < 0)
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-
-    if (spooler != SPOOLER_CUPS)
-        _log("file converter command: %s\n", fileconv);
-
-    if (dup2(fileno(kid2out), fileno(stdin)) < 0) {
-        _log("kid1: Could not dup stdin\n");
-        fclose(kid2out);
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-    }
-    if (dup2(fileno(out), fileno(stdout)) < 0) {
-        _log("kid1: Could not dup stdout\n");
-        fclose(kid2out);
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-    }
-    if (debug && !redirect_log_to_stderr()) {
-        _log("Could not dup logh to stderr\n");
-        fclose(kid2out);
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-    }
-
-    /* Actually run the thing... */
-    status = run_system_process("fileconverter", fileconv);
-    fclose(out);
-    fclose(kid2out);
-    fclose(stdin);
-    fclose(stdout);
-
-    if (WIFEXITED(status)) {
-        if (WEXITSTATUS(status) == 0) {
-            wait_for_process(kid2);
-            _log("kid1 finished\n");
-            return EXIT_PRINTED;
-        }
-    }
-    else if (WIFSIGNALED(status)) {
-        switch (WTERMSIG(status)) {
-            case SIGUSR1: return EXIT_PRNERR;
-            case SIGUSR2: return EXIT_PRNERR_NORETRY;
-            case SIGTTIN: return EXIT_ENGAGED;
-        }
-    }
-    return EXIT_PRNERR;
-}
-
-
 /*
  *  This function is only used when the input data is not PostScript. Then it
  *  runs a filter which converts non-PostScript files into PostScript. The user
@@ -216,11 +129,12 @@ int exec_kid1(FILE *in, FILE *out, void *user_arg)
  */
 void get_fileconverter_handle(const char *alreadyread, FILE **fd, pid_t *pid)
 {
-    pid_t kid1;
-    FILE *kid1out;
+    pid_t converter;
+    FILE *converterin, *input;
     const char *pagesize;
     char *fileconv;
-    kid1_userdata_t kid1_userdata;
+    pump_t *feeder;
+    int savederr = -1;
 
     _log("\nStarting converter for non-PostScript files\n");
 
@@ -242,16 +156,32 @@ void get_fileconverter_handle(const char *alreadyread, FILE **fd, pid_t *pid)
         snprintf(get_current_job()->title, 128, "Documentation for the %s", printer_model);
 
     fileconv = fileconverter_from_template(fileconverter, pagesize, get_current_job()->title);
+    if (spooler != SPOOLER_CUPS)
+        _log("file converter command: %s\n", fileconv);
 
-    kid1_userdata.fileconv = fileconv;
-    kid1_userdata.alreadyread = alreadyread;
-    kid1 = start_process("kid1", exec_kid1, &kid1_userdata, NULL, &kid1out);
-    if (kid1 < 0)
+    /* The rest of the input, our stdin gets replaced by the output of the
+       converter */
+    if (!(input = fdopen(fcntl(fileno(stdin), F_DUPFD_CLOEXEC, 3), "r")))
         rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Cannot convert file to "
-                "Postscript (Cannot fork for kid1!)\n");
+                "Postscript (Cannot dup stdin)\n");
+
+    /* Actually run the thing... */
+    if (debug)
+        savederr = redirect_stderr_to_log();
+    converter = start_system_process("fileconverter", fileconv, &converterin, fd);
+    restore_stderr(savederr);
+    if (converter < 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Cannot convert file to "
+                "Postscript (Cannot start the file converter)\n");
+
+    /* Feed it with the data which we already read and then with the rest
+       of the input, while we read its output */
+    feeder = pump_feeder(converterin);
+    pump_add_data(feeder, alreadyread, strlen(alreadyread));
+    pump_add_stream(feeder, input);
+    pump_close(feeder);
 
-    *fd = kid1out;
-    *pid = kid1;
+    *pid = converter;
 
     free(fileconv);
 }
@@ -264,9 +194,18 @@ int close_fileconverter_handle(FILE *fileconverter_handle, pid_t fileconverter_p
     fclose(fileconverter_handle);
 
     status = wait_for_process(fileconverter_pid);
-    if (WIFEXITED(status))
-        return WEXITSTATUS(status);
-    else
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+    if (WIFEXITED(status)) {
+        if (WEXITSTATUS(status) == 0) {
+            _log("File converter finished\n");
+            return EXIT_PRINTED;
+        }
+    }
+    else if (WIFSIGNALED(status)) {
+        switch (WTERMSIG(status)) {
+            case SIGUSR1: return EXIT_PRNERR;
+            case SIGUSR2: return EXIT_PRNERR_NORETRY;
+            case SIGTTIN: return EXIT_ENGAGED;
+        }
+    }
+    return EXIT_PRNERR;
 }
-
@@ -30,6 +30,8 @@
 #include "spooler.h"
 #include "renderer.h"
 #include "fileconverter.h"
+#include "cache.h"
+#include "pump.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,7 +42,9 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <math.h>
 #include <signal.h>
 #include <pwd.h>
@@ -74,13 +78,28 @@ void close_log()
         fclose(logh);
 }
 
-int redirect_log_to_stderr()
+int redirect_stderr_to_log()
 {
-    if (dup2(fileno(logh), fileno(stderr)) < 0) {
+    int saved;
+
+    if (!logh || logh == stderr)
+        return -1;
+    if ((saved = fcntl(fileno(stderr), F_DUPFD_CLOEXEC, 3)) < 0 ||
+        dup2(fileno(logh), fileno(stderr)) < 0) {
         _log("Could not dup logh to stderr\n");
-        return 0;
+        if (saved >= 0)
+            close(saved);
+        return -1;
     }
-    return 1;
+    return saved;
+}
+
+void restore_stderr(int saved)
+{
+    if (saved < 0)
+        return;
+    dup2(saved, fileno(stderr));
+    close(saved);
 }
 
 void rip_die(int status, const char *msg, ...)
@@ -111,6 +130,7 @@ jobparams_t * get_current_job()
 
 dstr_t *postpipe;  /* command into which the output of this filter should be piped */
 FILE *postpipe_fh = NULL;
+static pid_t postpipe_pid = 0;
 
 FILE * open_postpipe()
 {
@@ -127,13 +147,31 @@ FILE * open_postpipe()
     if (*p && *p == '|')
         p += 1;
 
-    if (start_system_process("postpipe", p, &postpipe_fh, NULL) < 0)
+    if ((postpipe_pid = start_system_process("postpipe", p, &postpipe_fh, NULL)) < 0)
         rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
                 "Cannot execute postpipe %s\n", postpipe->data);
 
     return postpipe_fh;
 }
 
+/* Close the postpipe opened by this process and wait for it */
+int close_postpipe()
+{
+    int status;
+
+    if (!postpipe_fh || postpipe_fh == stdout) {
+        fflush(stdout);
+        return EXIT_PRINTED;
+    }
+
+    fclose(postpipe_fh);
+    postpipe_fh = NULL;
+    status = wait_for_process(postpipe_pid);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return EXIT_PRINTED;
+    return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+}
+
 
 char printer_model[256] = "";
 const char *accounting_prolog = NULL;
@@ -155,6 +193,11 @@ dstr_t *backendoptions = NULL;
 
 /* These variables were in 'dat' before */
 char colorprofile [128];
+
+/* Pages to print ("page-ranges" option), empty for all */
+char pageranges [256] = "";
+/* Print the pages in reverse order ("outputorder=reverse" option) */
+int reverseorder = 0;
 char cupsfilter[256];
 char **jclprepend = NULL;
 dstr_t *jclappend;
@@ -182,6 +225,53 @@ char cupsfilterpath[PATH_MAX] = "/usr/local/lib/cups/filter:"
 
 char modern_shell[64] = "/bin/bash";
 
+/* Memory ceilings for the PostScript processing: header and buffered page
+   data beyond ps_buffer_limit bytes are moved into temporary files, lines
+   longer than ps_line_limit bytes are processed in chunks of this size */
+size_t ps_buffer_limit = 16 * 1024 * 1024;
+size_t ps_line_limit = 256 * 1024;
+
+/* Directory and size limit of the cache for converted files, no cache if
+   the directory is not set */
+char cache_dir[PATH_MAX] = "";
+size_t cache_size = 512 * 1024 * 1024;
+
+/* Temporary files up to this size are kept in memory */
+size_t temp_memory_limit = 64 * 1024 * 1024;
+
+/* Start the renderer for DSC-conforming jobs already when the PostScript
+   header begins, it is kept if the header does not change the command line */
+int ps_early_renderer = 1;
+
+/* How many renderers may work on runs of pages of a PDF job at the same
+   time, 0 means one per processor */
+int pdf_renderers = 0;
+
+/* PDF files which have to be converted to PostScript are split into this
+   many chunks of pages, converted at the same time, 0 or 1 to not split */
+int pdf_convert_chunks = 0;
+
+/* Seconds the child processes get to terminate when the job is cancelled,
+   before they are killed */
+int kill_grace_time = 8;
+
+/* Size value from the config file, with optional "k", "M" or "G" suffix */
+static size_t parse_size(const char *value, size_t def)
+{
+    char *end;
+    size_t size;
+
+    if (isempty(value))
+        return def;
+    size = strtoul(value, &end, 10);
+    switch (toupper(*end)) {
+        case 'K': return size << 10;
+        case 'M': return size << 20;
+        case 'G': return size << 30;
+    }
+    return size;
+}
+
 void config_set_option(const char *key, const char *value)
 {
     if (strcmp(key, "debug") == 0)
@@ -204,6 +294,27 @@ void config_set_option(const char *key, const char *value)
         strlcpy(gspath, value, PATH_MAX);
     else if (strcmp(key, "echo") == 0)
         strlcpy(echopath, value, PATH_MAX);
+    else if (strcmp(key, "ps_buffer_limit") == 0)
+        ps_buffer_limit = parse_size(value, ps_buffer_limit);
+    else if (strcmp(key, "ps_line_limit") == 0) {
+        ps_line_limit = parse_size(value, ps_line_limit);
+        if (ps_line_limit < 1024)
+            ps_line_limit = 1024;
+    }
+    else if (strcmp(key, "cache_dir") == 0)
+        strlcpy(cache_dir, value, PATH_MAX);
+    else if (strcmp(key, "cache_size") == 0)
+        cache_size = parse_size(value, cache_size);
+    else if (strcmp(key, "temp_memory_limit") == 0)
+        temp_memory_limit = parse_size(value, temp_memory_limit);
+    else if (strcmp(key, "ps_early_renderer") == 0)
+        ps_early_renderer = atoi(value);
+    else if (strcmp(key, "pdf_renderers") == 0)
+        pdf_renderers = atoi(value);
+    else if (strcmp(key, "pdf_convert_chunks") == 0)
+        pdf_convert_chunks = atoi(value);
+    else if (strcmp(key, "kill_grace_time") == 0)
+        kill_grace_time = atoi(value);
 }
 
 void config_from_file(const char *filename)
@@ -296,8 +407,11 @@ char * extract_next_option(char *str, char **pagerange, char **key, char **value
         p++;
     }
     else {
+        /* The commas in "page-ranges=1-3,7" do not separate options */
         *value = p;
-        while (*p && *p != ' ' && *p != ',') p++;
+        while (*p && *p != ' ' &&
+               (*p != ',' || (!strcasecmp(*key, "page-ranges") && isdigit(p[1]))))
+            p++;
         if (*p == '\0')
             return NULL;
         *p = '\0';
@@ -338,6 +452,18 @@ void process_cmdline_options()
             strlcpy(colorprofile, value, 128);
             continue;
         }
+        /* Page selection, under CUPS the pstops filter has done it already */
+        if (!strcasecmp(key, "page-ranges") && value) {
+            if (spooler != SPOOLER_CUPS)
+                strlcpy(pageranges, value, 256);
+            continue;
+        }
+        /* Output order, also done by pstops under CUPS */
+        if (!strcasecmp(key, "outputorder") && value) {
+            if (spooler != SPOOLER_CUPS)
+                reverseorder = !strcasecmp(value, "reverse");
+            continue;
+        }
         /* Solaris options that have no reason to be */
         if (!strcmp(key, "nobanner") || !strcmp(key, "dest") || !strcmp(key, "protocol"))
             continue;
@@ -900,30 +1026,34 @@ We buffer the data only as long as we didn't determing which filters to
 use for this piece of data and with which options. There are no temporary
 files used.
 
-foomatic-rip splits into up to 6 parallel processes to do the whole
+foomatic-rip has only these processes of its own to do the whole
 filtering (listed in the order of the data flow):
 
    KID0: Generate documentation pages (only jobs with "docs" option)
-   KID2: Put together already read data and current input stream for
-         feeding into the file conversion filter (only non-PostScript
-         and "docs" jobs)
-   KID1: Run the file conversion filter to convert non-PostScript
-         input into PostScript (only non-PostScript and "docs" jobs)
+   PDF-TO-PS: Convert a PDF file to PostScript in chunks of pages,
+         one converter for each, and merge their output (only
+         with "pdf_convert_chunks", not under CUPS)
    MAIN: Prepare the job auto-detecting the spooler, reading the PPD,
          extracting the options from the command line, and parsing
          the job data itself. It analyses the job data to check
-         whether it is PostScript and starts KID1/KID2 if not, it
-         also stuffs PostScript code from option settings into the
-         PostScript data stream. It starts the renderer (KID3/KID4)
-         as soon as it knows its command line and restarts it when
+         whether it is PostScript and starts the file conversion
+         filter if not, which it feeds with the already read data
+         and the rest of the input stream while it reads the
+         converted data. It also stuffs PostScript code from option
+         settings into the PostScript data stream. It starts the
+         renderer (in most cases Ghostscript, "cat" for native
+         PostScript printers with their manufacturer's PPD files) as
+         soon as it knows its command line and restarts it when
          page-specific option settings need another command line
-         or different JCL commands.
-   KID3: The rendering process. In most cases Ghostscript, "cat"
-         for native PostScript printers with their manufacturer's
-         PPD files.
-   KID4: Put together the JCL commands and the renderer's output
-         and send all that either to STDOUT or pipe it into the
-         command line defined with $postpipe. */
+         or different JCL commands. It reads the renderer's output
+         from a pipe, puts the JCL commands around it and sends all
+         that either to STDOUT or pipes it into the command line
+         defined with $postpipe.
+
+The file conversion filter, the renderer and the postpipe are the
+only other processes. The data between them and MAIN is moved by
+"pumps" (pump.c), with one epoll set, whenever MAIN would otherwise
+wait for one of them, so that none of them blocks another one. */
 
 
 
@@ -969,6 +1099,123 @@ int guess_file_type(const char *begin, size_t len, int *startpos)
     return UNKNOWN_FILE;
 }
 
+/* Pass a file on to the postpipe (or to STDOUT) without looking at it, the
+   kernel moves the data with splice() or sendfile() */
+int print_raw(const char *filename)
+{
+    FILE *out = open_postpipe();
+    int fd, ok;
+
+    if (!strcasecmp(filename, "<STDIN>"))
+        fd = fileno(stdin);
+    else if ((fd = open(filename, O_RDONLY)) < 0) {
+        _log("Could not open \"%s\" for reading\n", filename);
+        return 0;
+    }
+
+    fflush(out);
+    ok = copy_fd(fileno(out), fd);
+    if (fd != fileno(stdin))
+        close(fd);
+    return ok;
+}
+
+/* Add the path, size and modification time of the executable 'name' to
+   'how', so that the digest changes when the program gets replaced */
+static void add_executable_to_key(dstr_t *how, const char *name)
+{
+    char dir[PATH_MAX] = "", path[PATH_MAX];
+    struct stat st;
+
+    if (strchr(name, '/') ||
+        !find_in_path(name, getenv("PATH") ? getenv("PATH") : "", dir) || !*dir ||
+        snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+        strlcpy(path, name, PATH_MAX);
+
+    if (stat(path, &st) == 0)
+        dstrcatf(how, "%s %lld %lld\n", path, (long long)st.st_size,
+                 (long long)st.st_mtime);
+    else
+        dstrcatf(how, "%s\n", name);
+}
+
+/* Digest of the PDF file and of the way it gets converted to PostScript.
+   With CUPS these are the arguments of the pdftops filter, the PPD file
+   which it reads and the filter itself. The job ID is left out, it is
+   different for every job and the filter does not put it into the
+   PostScript. Otherwise it is the command line 'cmd' without the file
+   name, the programs it runs and the chunk setting, merged chunks are not
+   the same PostScript as one conversion of the whole file. */
+static int pdf_to_ps_cache_key(const char *filename, const char *cmd, char hex[65])
+{
+    cache_key_t key;
+    dstr_t *how = create_dstr();
+    struct stat st;
+    int pos = 0;
+
+    if (spooler == SPOOLER_CUPS) {
+        dstrcatf(how, "pdftops\n%s\n%s\n%s\n", job->user, job->title, job->optstr->data);
+        if (stat(job->ppdfile, &st) == 0)
+            dstrcatf(how, "%s %lld %lld\n", job->ppdfile, (long long)st.st_size,
+                     (long long)st.st_mtime);
+        add_executable_to_key(how, "pdftops");
+    }
+    else {
+        dstrcpy(how, cmd);
+        while ((pos = dstrreplace(how, filename, "", pos)) >= 0)
+            ;
+        dstrcat(how, "\n");
+        add_executable_to_key(how, gspath);
+        add_executable_to_key(how, "pdftops");
+        dstrcatf(how, "chunks %d\n", pdf_convert_chunks);
+    }
+
+    cache_key_init(&key);
+    cache_key_add(&key, how->data, how->len);
+    free_dstr(how);
+    if (!cache_key_add_file(&key, filename))
+        return 0;
+    cache_key_final(&key, hex);
+    return 1;
+}
+
+/* Start the conversion of the PDF file to PostScript. Large files can be
+   converted in chunks of pages at the same time, not with the CUPS filter,
+   it would also apply the page selection of the job */
+static pid_t start_pdf_to_ps(const char *filename, const char *cmd, FILE **out)
+{
+    pid_t pid;
+
+    if (spooler != SPOOLER_CUPS && (pid = start_pdf_to_ps_chunks(filename, out)))
+        return pid;
+    return start_system_process("pdf-to-ps", cmd, NULL, out);
+}
+
+/* Convert the PDF file and keep a copy of the PostScript in the cache
+   entry: a pump of ours passes the output of the converter on to '*out'
+   and writes it into the entry, '*teed' becomes 1 when all of it is there */
+static pid_t start_pdf_to_ps_cached(const char *filename, const char *cmd,
+                                    cache_entry_t *entry, int *teed, FILE **out)
+{
+    FILE *ps, *relay;
+    pump_t *p;
+    int pfd[2];
+    pid_t pid;
+
+    if ((pid = start_pdf_to_ps(filename, cmd, &ps)) < 0)
+        return -1;
+    if (pipe2(pfd, O_CLOEXEC) != 0 ||
+        !(relay = fdopen(pfd[1], "w")) || !(*out = fdopen(pfd[0], "r")))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
+                "Could not create a pipe for the PostScript\n");
+
+    p = pump_feeder(relay);
+    pump_tee(p, entry->fd, teed);
+    pump_add_stream(p, ps);
+    pump_close(p);
+    return pid;
+}
+
 /*
  * Prints 'filename'. If 'convert' is true, the file will be converted if it is
  * not postscript or pdf
@@ -980,6 +1227,7 @@ int print_file(const char *filename, int convert)
     int type;
     int startpos;
     size_t n;
+    ssize_t r;
     FILE *fchandle = NULL;
     int fcpid = 0, ret;
 
@@ -993,7 +1241,13 @@ int print_file(const char *filename, int convert)
         }
     }
 
-    n = fread(buf, 1, sizeof(buf) - 1, file);
+    /* Read past stdio, so that the buffer of 'file' stays empty and the
+       input descriptor can be handed on to the renderer or spliced into
+       it when the job does not need to be parsed */
+    n = 0;
+    while (n < sizeof(buf) - 1 &&
+           (r = read_some(fileno(file), &buf[n], sizeof(buf) - 1 - n)) > 0)
+        n += r;
     buf[n] = '\0';
     type = guess_file_type(buf, n, &startpos);
     /* We do not use any JCL preceeded to the inputr data, as it is simply
@@ -1015,9 +1269,12 @@ int print_file(const char *filename, int convert)
             if (!ppd_supports_pdf())
             {
                 char pdf2ps_cmd[PATH_MAX];
-                FILE *out, *in;
+                FILE *out;
                 int renderer_pid;
-		char tmpfilename[PATH_MAX] = "";
+		char tmpfilename[PATH_MAX];
+		int tmpfd = -1, cachefd, keyed, cmdlen, status, teed = 0;
+		char key[65];
+		cache_entry_t *entry = NULL;
 
                 _log("Driver does not understand PDF input, "
                      "converting to PostScript\n");
@@ -1027,20 +1284,9 @@ int print_file(const char *filename, int convert)
 		/* If reading from stdin, write everything into a temporary file */
 		if (file == stdin)
                 {
-		    int fd;
-		    FILE *tmpfile;
-		    
-		    snprintf(tmpfilename, PATH_MAX, "%s/foomatic-XXXXXX", temp_dir());
-		    fd = mkstemp(tmpfilename);
-		    if (fd < 0) {
-		        _log("Could not create temporary file: %s\n", strerror(errno));
+		    if ((tmpfd = spool_to_temp_file(fileno(stdin), buf, n)) < 0)
 		        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-		    }
-		    tmpfile = fdopen(fd, "r+");
-		    copy_file(tmpfile, stdin, buf, n);
-		    fclose(tmpfile);
-		    
-		    filename = tmpfilename;
+		    filename = fd_path(tmpfd, tmpfilename);
 		}
 
 		/* If the spooler is CUPS we use the pdftops filter of CUPS,
@@ -1060,26 +1306,60 @@ int print_file(const char *filename, int convert)
 		   We give priority to Ghostscript here and use Poppler if
 		   Ghostscript is not available. */
 		if (spooler == SPOOLER_CUPS)
-		  snprintf(pdf2ps_cmd, PATH_MAX,
+		  cmdlen = snprintf(pdf2ps_cmd, PATH_MAX,
 			   "pdftops '%s' '%s' '%s' '%s' '%s' '%s'",
 			   job->id, job->user, job->title, "1", job->optstr->data,
 			   filename);
 		else
-		  snprintf(pdf2ps_cmd, PATH_MAX,
-			   "gs -q -sstdout=%%stderr -sDEVICE=ps2write -sOutputFile=- "
-			   "-dBATCH -dNOPAUSE -dPARANOIDSAFER -dNOINTERPOLATE %s 2>/dev/null || "
-			   "pdftops -level2 -origpagesizes %s - 2>/dev/null",
-			   filename, filename);
+		  cmdlen = snprintf(pdf2ps_cmd, PATH_MAX,
+			   "%s -q -sstdout=%%stderr -sDEVICE=ps2write -sOutputFile=- "
+			   "-dBATCH -dNOPAUSE -dPARANOIDSAFER -dNOINTERPOLATE '%s' 2>/dev/null || "
+			   "pdftops -level2 -origpagesizes '%s' - 2>/dev/null",
+			   gspath, filename, filename);
+		if (cmdlen >= PATH_MAX)
+		    rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
+		            "PDF to PostScript command line too long\n");
+
+		/* The same file converted before */
+		keyed = cache_enabled() && pdf_to_ps_cache_key(filename, pdf2ps_cmd, key);
+		if (keyed && (cachefd = cache_lookup("ps", key)) >= 0)
+		{
+		    if (dup2(cachefd, fileno(stdin)) < 0)
+		        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
+		                "Couldn't dup the cached PostScript\n");
+		    close(cachefd);
+		    if (tmpfd >= 0)
+		        close(tmpfd);
+		    return print_file("<STDIN>", 0);
+		}
 
-                renderer_pid = start_system_process("pdf-to-ps", pdf2ps_cmd, &in, &out);
+                /* Keep a copy of the PostScript in the cache */
+                if (keyed && (entry = cache_store_begin("ps", key)))
+                    renderer_pid = start_pdf_to_ps_cached(filename, pdf2ps_cmd,
+                                                          entry, &teed, &out);
+                else
+                    renderer_pid = start_pdf_to_ps(filename, pdf2ps_cmd, &out);
 
-                if (dup2(fileno(out), fileno(stdin)) < 0)
+                if (renderer_pid < 0 || dup2(fileno(out), fileno(stdin)) < 0) {
+                    if (entry)
+                        cache_store_abort(entry);
                     rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
                             "Couldn't dup stdout of pdf-to-ps\n");
+                }
+                fclose(out);
 
                 ret = print_file("<STDIN>", 0);
 
-                wait_for_process(renderer_pid);
+                /* The entry is complete when the conversion succeeded */
+                status = wait_for_process(renderer_pid);
+                if (entry) {
+                    if (teed > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                        cache_store_commit(entry);
+                    else
+                        cache_store_abort(entry);
+                }
+                if (tmpfd >= 0)
+                    close(tmpfd);
                 return ret;
             }
 
@@ -1102,6 +1382,14 @@ int print_file(const char *filename, int convert)
             }
 
             _log("Filetype unknown, trying to convert ...\n");
+            /* The converter gets its input from stdin, a file from the
+               beginning, it has been rewound */
+            if (file != stdin) {
+                if (dup2(fileno(file), fileno(stdin)) < 0)
+                    rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Couldn't dup the input file\n");
+                fclose(file);
+                buf[0] = '\0';
+            }
             get_fileconverter_handle(buf, &fchandle, &fcpid);
 
             /* Read further data from the file converter and not from STDIN */
@@ -1182,6 +1470,9 @@ int main(int argc, char** argv)
 
     signal(SIGTERM, signal_terminate);
     signal(SIGINT, signal_terminate);
+    /* A child process which stops reading its input shows as a write
+       error, the data for the other ones keeps flowing */
+    signal(SIGPIPE, SIG_IGN);
 
 
     config_from_file(CONFIG_PATH "/filter.conf");
@@ -1656,9 +1947,10 @@ int main(int argc, char** argv)
         if (dontparse == 2) {
             /* Raw queue, simply pass the input into the postpipe (or to STDOUT
                when there is no postpipe) */
-            _log("Raw printing, executing \"cat %s\"\n\n");
-            snprintf(tmp, 1024, "cat %s", postpipe->data);
-            run_system_process("raw-printer", tmp);
+            _log("Raw printing, passing the input data on unchanged\n\n");
+            if (!print_raw(filename))
+                rip_die(EXIT_PRNERR_NORETRY, "Could not print file %s\n", filename);
+            filename = strtok_r(NULL, " ", &p);
             continue;
         }
 
@@ -1687,6 +1979,10 @@ int main(int argc, char** argv)
     /* Close the last input file */
     fclose(stdin);
 
+    /* The postpipe is kept open over all files of the job */
+    if (close_postpipe() != EXIT_PRINTED)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Error closing postpipe\n");
+
     /* TODO dump everything in $dat when debug is turned on (necessary?) */
 
     _log("\nClosing foomatic-rip.\n");
@@ -112,11 +112,16 @@ typedef struct {
 jobparams_t * get_current_job();
 
 void _log(const char* msg, ...);
-int redirect_log_to_stderr();
+/* Let the messages of the child processes started until restore_stderr()
+   go into the log, returns the copy of stderr for that (-1 if stderr is
+   unchanged) */
+int redirect_stderr_to_log();
+void restore_stderr(int saved);
 void rip_die(int status, const char *msg, ...);
 
 const char * get_modern_shell();
 FILE * open_postpipe();
+int close_postpipe();
 
 extern struct dstr *currentcmd;
 extern struct dstr *jclappend;
@@ -132,6 +137,17 @@ extern int dontparse;
 extern int pdfconvertedtops;
 extern char gspath[PATH_MAX];
 extern char echopath[PATH_MAX];
+extern size_t ps_buffer_limit;
+extern size_t ps_line_limit;
+extern size_t temp_memory_limit;
+extern char cache_dir[PATH_MAX];
+extern size_t cache_size;
+extern int ps_early_renderer;
+extern int pdf_renderers;
+extern int pdf_convert_chunks;
+extern int kill_grace_time;
+extern char pageranges[256];
+extern int reverseorder;
 
 #endif
 
@@ -43,6 +43,10 @@ char printer_id [256];
 char driver [128];
 char cmd [4096];
 char cmd_pdf [4096];
+
+/* The command lines contain data of the job (&job; ...) */
+static int cmd_job_entities = 0, cmd_pdf_job_entities = 0;
+
 dstr_t *postpipe = NULL;  /* command into which the output of this
                              filter should be piped */
 int ps_accounting = 1;
@@ -1145,7 +1149,9 @@ static choice_t * option_assure_choice(option_t *opt, const char *name)
     return choice;
 }
 
-static void unhtmlify(char *dest, size_t size, const char *src)
+/* Returns the number of replaced entities with data of the job, like &job;
+   or &date; */
+static int unhtmlify(char *dest, size_t size, const char *src)
 {
     jobparams_t *job = get_current_job();
     char *pdest = dest;
@@ -1154,6 +1160,7 @@ static void unhtmlify(char *dest, size_t size, const char *src)
     struct tm *t = localtime(&job->time);
     char tmpstr[10];
     size_t s, l, n;
+    int jobentities = 0, jobentity;
 
     while (*psrc && pdest - dest < size - 1) {
 
@@ -1162,23 +1169,29 @@ static void unhtmlify(char *dest, size_t size, const char *src)
             repl = NULL;
             p = NULL;
             l = 0;
+            jobentity = 1;
 
             /* Replace HTML/XML entities by the original characters */
             if (!prefixcmp(psrc, "apos")) {
                 repl = "\'";
                 p = psrc + 4;
+                jobentity = 0;
             } else if (!prefixcmp(psrc, "quot")) {
                 repl = "\"";
                 p = psrc + 4;
+                jobentity = 0;
             } else if (!prefixcmp(psrc, "gt")) {
                 repl = ">";
                 p = psrc + 2;
+                jobentity = 0;
             } else if (!prefixcmp(psrc, "lt")) {
                 repl = "<";
                 p = psrc + 2;
+                jobentity = 0;
             } else if (!prefixcmp(psrc, "amp")) {
                 repl = "&";
                 p = psrc + 3;
+                jobentity = 0;
 
             /* Replace special entities by job->data */
             } else if (!prefixcmp(psrc, "job")) {
@@ -1257,6 +1270,8 @@ static void unhtmlify(char *dest, size_t size, const char *src)
             } else
                 repl = NULL;
             if (repl) {
+                if (jobentity)
+                    jobentities++;
                 if ((l == 0) || (l > strlen(repl)))
                     l = strlen(repl);
                 s = size - (pdest - dest) - 1;
@@ -1279,6 +1294,7 @@ static void unhtmlify(char *dest, size_t size, const char *src)
         }
     }
     *pdest = '\0';
+    return jobentities;
 }
 
 /*
@@ -1324,8 +1340,10 @@ void option_set_choice(option_t *opt, const char *name, const char *text,
         return;
     }
 
-    if (!startswith(code, "%% FoomaticRIPOptionSetting"))
-        unhtmlify(choice->command, 65536, code);
+    if (!startswith(code, "%% FoomaticRIPOptionSetting")) {
+        choice->job_entities = unhtmlify(choice->command, 65536, code);
+        choice->active_ps = contains_active_postscript(choice->command);
+    }
 }
 
 /*
@@ -1366,7 +1384,8 @@ void option_set_custom_command(option_t *opt, const char *cmd)
     size_t len = strlen(cmd) + 50;
     free(opt->custom_command);
     opt->custom_command = malloc(len);
-    unhtmlify(opt->custom_command, len, cmd);
+    if (unhtmlify(opt->custom_command, len, cmd))
+        opt->job_entities = 1;
 }
 
 param_t * option_add_custom_param_from_string(option_t *opt,
@@ -1547,6 +1566,33 @@ int optionset_equal(int optset1, int optset2, int exceptPS)
     return 1;
 }
 
+/*
+ *  Like optionset_equal(optset1, optset2, 1), but PostScript options in
+ *  section JCLSetup are compared as well, as build_commandline() puts their
+ *  code into the JCL header and a change needs a new renderer
+ */
+int optionset_equal_renderer(int optset1, int optset2)
+{
+    option_t *opt;
+    const char *val1, *val2;
+
+    for (opt = optionlist; opt; opt = opt->next) {
+        if (opt->style == 'G' && option_get_section(opt) != SECTION_JCLSETUP)
+            continue;
+
+        val1 = option_get_value(opt, optset1);
+        val2 = option_get_value(opt, optset2);
+
+        if (val1 && val2) {
+            if (strcmp(val1, val2) != 0)
+                return 0;
+        }
+        else if (val1 || val2)
+            return 0;
+    }
+    return 1;
+}
+
 /*
  *  read_ppd_file()
  */
@@ -1644,10 +1690,10 @@ void read_ppd_file(const char *filename)
             unhtmlify(postpipe->data, postpipe->alloc, value->data);
         }
         else if (strcmp(key, "FoomaticRIPCommandLine") == 0) {
-            unhtmlify(cmd, 4096, value->data);
+            cmd_job_entities = unhtmlify(cmd, 4096, value->data);
         }
         else if (strcmp(key, "FoomaticRIPCommandLinePDF") == 0) {
-            unhtmlify(cmd_pdf, 4096, value->data);
+            cmd_pdf_job_entities = unhtmlify(cmd_pdf, 4096, value->data);
         }
         else if (strcmp(key, "FoomaticRIPNoPageAccounting") == 0) {
             /* Boolean value */
@@ -1716,7 +1762,8 @@ void read_ppd_file(const char *filename)
                Used for numerical and string options only */
             opt = assure_option(name);
             opt->proto = malloc(65536);
-            unhtmlify(opt->proto, 65536, value->data);
+            if (unhtmlify(opt->proto, 65536, value->data))
+                opt->job_entities = 1;
         }
         else if (!strcmp(key, "FoomaticRIPOptionRange")) {
             /* *FoomaticRIPOptionRange <option>: <min> <max>
@@ -1894,25 +1941,54 @@ void read_ppd_file(const char *filename)
     free (icc_qual3);
 }
 
+/*
+ * Does the setting 'val' of 'opt' insert PostScript code into the job?
+ */
+static int value_inserts_postscript(option_t *opt, value_t *val)
+{
+    choice_t *choice;
+    dstr_t *code;
+    int active;
+
+    /* Predefined choice, see option_get_command() */
+    choice = option_find_choice(opt, val->value);
+    if (choice && (*choice->command ||
+                   (opt->type != TYPE_INT && opt->type != TYPE_FLOAT)))
+        return choice->active_ps;
+
+    /* Custom value */
+    code = create_dstr();
+    option_get_command(code, opt, val->optionset, -1);
+    active = contains_active_postscript(code->data);
+    free_dstr(code);
+    return active;
+}
+
 int ppd_supports_pdf()
 {
     option_t *opt;
+    value_t *val;
+    int header = optionset("header");
 
-    /* If at least one option inserts PostScript code, we cannot support PDF */
+    /* If at least one of the settings of the job (for the whole document
+       or for certain pages) inserts PostScript code, we cannot support PDF */
     for (opt = optionlist; opt; opt = opt->next)
     {
-        choice_t *choice;
-
         if (!option_is_ps_command(opt) || option_is_composite(opt) ||
 	    (opt->type == TYPE_NONE))
 	  continue;
 
-        for (choice = opt->choicelist; choice; choice = choice->next)
-	  if (contains_active_postscript(choice->command)) {
-	    _log("  PostScript option found: %s=%s: \"%s\"\n",
-		 opt->name, choice->value, choice->command);
-	    return 0;
-	  }
+        for (val = opt->valuelist; val; val = val->next)
+        {
+            if (val->optionset != header &&
+                !startswith(optionset_name(val->optionset), "pages:"))
+                continue;
+
+	    if (value_inserts_postscript(opt, val)) {
+	      _log("  PostScript option found: %s=%s\n", opt->name, val->value);
+	      return 0;
+	    }
+        }
     }
 
     if (!isempty(cmd_pdf))
@@ -1923,6 +1999,7 @@ int ppd_supports_pdf()
     if (startswith(cmd, "gs"))
     {
         strncpy(cmd_pdf, cmd, 4096);
+        cmd_pdf_job_entities = cmd_job_entities;
         return 1;
     }
 
@@ -1930,6 +2007,27 @@ int ppd_supports_pdf()
     return 0;
 }
 
+/* Do the command line or the JCL for 'optset' contain data of the job (like
+   &job; or &date;), which differs from job to job? */
+int optionset_uses_job_entities(int optset, int pdfcmdline)
+{
+    option_t *opt;
+    value_t *val;
+    choice_t *choice;
+
+    if (pdfcmdline ? cmd_pdf_job_entities : cmd_job_entities)
+        return 1;
+
+    for (opt = optionlist; opt; opt = opt->next) {
+        if (!(val = option_find_value(opt, optset)))
+            continue;
+        if ((choice = option_find_choice(opt, val->value)) ?
+            choice->job_entities : opt->job_entities)
+            return 1;
+    }
+    return 0;
+}
+
 /* build a renderer command line, based on the given option set */
 int build_commandline(int optset, dstr_t *cmdline, int pdfcmdline)
 {
@@ -1978,9 +2076,15 @@ int build_commandline(int optset, dstr_t *cmdline, int pdfcmdline)
                         break;
 
                     case SECTION_ANYSETUP:
+                        /* On a page the setting is needed if it differs
+                           from the header or from the previous page, as
+                           the renderer is not restarted when only
+                           PostScript options change */
                         if (optset != optionset("currentpage"))
                             dstrcatf(setupprepend, "%s%s%s", open->data, cmdvar->data, close->data);
-                        else if (strcmp(option_get_value(opt, optionset("header")), userval) != 0)
+                        else if (strcmp(option_get_value(opt, optionset("header")), userval) != 0 ||
+                                 ((s = (char *)option_get_value(opt, optionset("previouspage"))) &&
+                                  strcmp(s, userval) != 0))
                             dstrcatf(pagesetupprepend, "%s%s%s", open->data, cmdvar->data, close->data);
                         break;
 
@@ -2139,6 +2243,28 @@ void append_page_setup_section(dstr_t *str, int optset, int comments)
         dstrcat(str, "%%EndPageSetup\n");
 }
 
+/* Would the append_*_section() functions insert any code for 'optset'? */
+int option_code_to_insert(int optset)
+{
+    if (spooler == SPOOLER_CUPS && ps_accounting == 1)
+        return 1;
+
+    build_commandline(optset, NULL, 0);
+    if (((spooler != SPOOLER_CUPS) || pdfconvertedtops) &&
+        (prologprepend->len || setupprepend->len))
+        return 1;
+    return pagesetupprepend->len != 0;
+}
+
+/* The PostScript code of all sections for 'optset', for the keys of the
+   render cache */
+void get_option_code(dstr_t *str, int optset)
+{
+    build_commandline(optset, NULL, 0);
+    dstrcpy(str, prologprepend->data);
+    dstrcat(str, setupprepend->data);
+    dstrcat(str, pagesetupprepend->data);
+}
 
 typedef struct page_range {
     short even, odd;
@@ -2245,6 +2371,25 @@ int get_page_score(const char *pages, int page)
     return 0;
 }
 
+/* Are there option settings for certain pages only? */
+int page_specific_options()
+{
+    option_t *opt;
+    value_t *val;
+
+    for (opt = optionlist; opt; opt = opt->next)
+        for (val = opt->valuelist; val; val = val->next)
+            if (startswith(optionset_name(val->optionset), "pages:"))
+                return 1;
+    return 0;
+}
+
+/* Is 'page' among the pages selected with the "page-ranges" option? */
+int page_selected(int page)
+{
+    return isempty(pageranges) || get_page_score(pageranges, page) > 0;
+}
+
 /* Set the options for a given page */
 void set_options_for_page(int optset, int page)
 {
@@ -56,6 +56,8 @@ typedef struct choice_s {
     char value [128];
     char text [128];
     char command[65536];
+    int active_ps;         /* command contains more than comments */
+    int job_entities;      /* command contains data of the job (&job; ...) */
     struct choice_s *next;
 } choice_t;
 
@@ -100,6 +102,8 @@ typedef struct option_s {
     char *custom_command;       /* *CustomFoo */
     param_t *paramlist;         /* for custom values, sorted by stack order */
     size_t param_count;
+    int job_entities;           /* proto or custom_command contain data of
+                                   the job (&job; ...) */
 
     struct value_s *valuelist;
 
@@ -151,6 +155,7 @@ option_t *find_option(const char *name);
 void read_ppd_file(const char *filename);
 
 int ppd_supports_pdf();
+int optionset_uses_job_entities(int optset, int pdfcmdline);
 
 
 int option_set_value(option_t *opt, int optset, const char *value);
@@ -169,14 +174,19 @@ int optionset(const char * name);
 
 void optionset_copy_values(int src_optset, int dest_optset);
 int optionset_equal(int optset1, int optset2, int exceptPS);
+int optionset_equal_renderer(int optset1, int optset2);
 void optionset_delete_values(int optionset);
 
 void append_prolog_section(dstr_t *str, int optset, int comments);
 void append_setup_section(dstr_t *str, int optset, int comments);
 void append_page_setup_section(dstr_t *str, int optset, int comments);
+int option_code_to_insert(int optset);
+void get_option_code(dstr_t *str, int optset);
 int build_commandline(int optset, dstr_t *cmdline, int pdfcmdline);
 
 void set_options_for_page(int optset, int page);
+int page_selected(int page);
+int page_specific_options();
 const char *get_icc_profile_for_qualifier(const char **qualifier);
 const char **get_ppd_qualifier(void);
 
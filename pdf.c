@@ -26,32 +26,45 @@
 #include "options.h"
 #include "process.h"
 #include "renderer.h"
+#include "pdfparser.h"
+#include "cache.h"
+#include "pump.h"
 
 #include <stdlib.h>
 #include <ctype.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
 
-static int wait_for_renderer();
+static int finish_renderer();
 
 
-static int pdf_count_pages(const char *filename)
+static int pdf_count_pages(pdf_file_t *pdf, const char *filename)
 {
     char gscommand[4095];
     char output[31] = "";
     int pagecount;
 
+    /* Read the page count from the page tree, only damaged or encrypted
+       files and unsupported compression need Ghostscript */
+    if (pdf && (pagecount = pdf_page_count(pdf)) > 0)
+        return pagecount;
+    _log("Could not read the page count from the PDF file, asking Ghostscript\n");
+
     snprintf(gscommand, 4095, "%s -dNODISPLAY -q -c "
 	     "'/pdffile (%s) (r) file def pdfdict begin pdffile pdfopen begin "
 	     "(PageCount: ) print pdfpagecount == flush currentdict pdfclose "
 	     "end end quit'",
 	     gspath, filename);
 
+    inherit_fd_paths(gscommand, 1);
     FILE *pd = popen(gscommand, "r");
+    inherit_fd_paths(gscommand, 0);
     if (!pd)
       rip_die(EXIT_STARVED, "Failed to execute ghostscript to determine number of input pages!\n");
 
@@ -64,44 +77,132 @@ static int pdf_count_pages(const char *filename)
     return pagecount;
 }
 
-pid_t kid3 = 0;
+/* Renderers for runs of pages. Up to pdf_renderers of them work at the same
+   time, the output of all but the oldest one is held back in a spill file
+   until the ones before it are done, so that it goes out in the order of
+   the pages. Each one wraps its output in the JCL, as before, whether it is
+   held back or not. The postpipe is opened once, the output of the oldest
+   renderer goes into it directly and the held-back output gets copied into
+   it. */
+typedef struct renderer {
+    pid_t pid;              /* 0 if the output came from the cache */
+    int heldback;           /* 0 if the output goes to the postpipe */
+    spillfile_t out;        /* held-back output */
+    FILE *outfh;            /* stream writing into 'out' */
+    int tmpfd;              /* extracted pages, closed when done */
+} renderer_t;
+
+#define MAX_RENDERERS 16
+
+static renderer_t renderers[MAX_RENDERERS];
+static int renderers_running = 0;
+
+/* Digest of the PDF file for the keys of the render cache, empty if the
+   output is not cached */
+static char input_digest[65] = "";
+
+/* Cache entry for the next renderer which gets started */
+static cache_entry_t *render_entry = NULL;
+
+static int max_renderers()
+{
+    long n = pdf_renderers;
 
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    return n < MAX_RENDERERS ? n : MAX_RENDERERS;
+}
 
-static int start_renderer(const char *cmd)
+/* Start the renderer, if 'in' is given it gets a handle for feeding the
+   renderer with the PDF data. 'tmpfd' is closed when it has finished.
+   Without 'cmd' the output comes from the cache file 'cachefd'. */
+static int launch_renderer(const char *cmd, FILE **in, int tmpfd, int cachefd)
 {
-    if (kid3 != 0)
-        wait_for_renderer();
-
-    _log("Starting renderer with command: %s\n", cmd);
-    kid3 = start_process("kid3", exec_kid3, (void *)cmd, NULL, NULL);
-    if (kid3 < 0)
-        rip_die(EXIT_STARVED, "Could not start renderer\n");
+    renderer_t *r;
+    FILE *out;
+
+    if (renderers_running >= max_renderers())
+        finish_renderer();
+
+    r = &renderers[renderers_running];
+    r->heldback = renderers_running > 0;
+    if (r->heldback) {
+        if (!create_spillfile(&r->out) || !(r->outfh = spillfopen(&r->out)))
+            rip_die(EXIT_STARVED, "Could not create a buffer for the renderer output\n");
+        out = r->outfh;
+    }
+    else
+        out = open_postpipe();
+    r->tmpfd = tmpfd;
+
+    if (cmd) {
+        _log("Starting renderer with command: %s\n", cmd);
+        r->pid = start_renderer_command(cmd, in, 0, out, render_entry);
+        render_entry = NULL;
+        if (r->pid < 0)
+            rip_die(EXIT_STARVED, "Could not start renderer\n");
+    }
+    else {
+        _log("Sending the cached renderer output\n");
+        r->pid = 0;
+        if (!send_cached_output(cachefd, out))
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not send the cached renderer output\n");
+        close(cachefd);
+    }
+    renderers_running++;
 
     return 1;
 }
 
-static int wait_for_renderer()
+static int start_renderer(const char *cmd, FILE **in, int tmpfd)
 {
-    int status;
-
-    waitpid(kid3, &status, 0);
+    return launch_renderer(cmd, in, tmpfd, -1);
+}
 
-    if (!WIFEXITED(status)) {
-        _log("Kid3 did not finish normally.\n");
-        exit(EXIT_PRNERR_NORETRY_BAD_SETTINGS);
+/* Wait for the oldest renderer and send its held-back output */
+static int finish_renderer()
+{
+    renderer_t *r = &renderers[0];
+    FILE *out;
+    int retval, fd;
+
+    if (r->pid) {
+        retval = close_renderer(r->pid);
+        if (retval != EXIT_PRINTED)
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Renderer failed\n");
+    }
+    if (r->tmpfd >= 0)
+        close(r->tmpfd);
+
+    if (r->heldback) {
+        if (fclose(r->outfh) != 0)
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
+                    "Could not buffer the renderer output\n");
+        out = open_postpipe();
+        fflush(out);
+        fd = spillfinish(&r->out);
+        if (!copy_fd(fileno(out), fd))
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS,
+                    "Could not send the renderer output\n");
+        close(fd);
     }
 
-    _log("Kid3 exit status: %d\n", WEXITSTATUS(status));
-    if (WEXITSTATUS(status) != 0)
-        exit(EXIT_PRNERR_NORETRY_BAD_SETTINGS);
-
-    kid3 = 0;
+    renderers_running--;
+    memmove(&renderers[0], &renderers[1], renderers_running * sizeof(renderer_t));
     return 1;
 }
 
+static void wait_for_renderers()
+{
+    while (renderers_running > 0)
+        finish_renderer();
+}
+
 /*
  * Extract pages 'first' through 'last' from the pdf and write them into a
- * temporary file.
+ * temporary file. Returns the file, 'filename' is set to its /dev/fd path.
  */
 static int pdf_extract_pages(char filename[PATH_MAX],
                              const char *pdffilename,
@@ -110,61 +211,96 @@ static int pdf_extract_pages(char filename[PATH_MAX],
 {
     char gscommand[4095];
     char filename_arg[PATH_MAX], first_arg[50], last_arg[50];
+    struct stat st;
     int fd;
 
     _log("Extracting pages %d through %d\n", first, last);
 
-    snprintf(filename, PATH_MAX, "%s/foomatic-XXXXXX", temp_dir());
-    if ((fd = mkstemp(filename)) == -1)
+    /* The pages will hardly take more space than the whole file */
+    if (stat(pdffilename, &st) != 0)
+        st.st_size = 0;
+    if ((fd = create_temp_file(st.st_size)) < 0)
         rip_die(EXIT_STARVED, "Unable to create temporary file!\n");
-    close (fd);
+    fd_path(fd, filename);
 
     snprintf(filename_arg, PATH_MAX, "-sOutputFile=%s", filename);
     snprintf(first_arg, 50, "-dFirstPage=%d", first);
     if (last > 0)
         snprintf(last_arg, 50, "-dLastPage=%d", last);
     else
-        first_arg[0] = '\0';
+        last_arg[0] = '\0';
 
-    snprintf(gscommand, 4095, "%s -q -dNOPAUSE -dBATCH -dPARANOIDSAFER -dNOINTERPOLATE"
+    snprintf(gscommand, 4095, "%s -q -dNOPAUSE -dBATCH -dPARANOIDSAFER -dNOINTERPOLATE "
 	     "-sDEVICE=pdfwrite %s %s %s %s",
 	     gspath, filename_arg, first_arg, last_arg, pdffilename);
 
+    /* Only Ghostscript gets the descriptors, not the later children */
+    inherit_fd_paths(gscommand, 1);
     FILE *pd = popen(gscommand, "r");
+    inherit_fd_paths(gscommand, 0);
     if (!pd)
         rip_die(EXIT_STARVED, "Could not run ghostscript to extract the pages!\n");
     pclose(pd);
 
+    return fd;
+}
+
+/*
+ * Feed the renderer with the whole file, followed by an incremental update
+ * which replaces the page tree by one with only the pages 'first' through
+ * 'last'. The file is copied by the kernel, nothing gets re-interpreted.
+ * A pump feeds it while the next renderers get started, so the renderers
+ * of the subsets read their input at the same time.
+ */
+static int render_page_subset(dstr_t *cmd, pdf_file_t *pdf, int firstpage, int lastpage)
+{
+    dstr_t *update;
+    FILE *in;
+    pump_t *feeder;
+
+    if (!(update = pdf_page_subset(pdf, firstpage, lastpage)))
+        return 0;
+
+    _log("Sending pages %d through %d to the renderer\n", firstpage, lastpage);
+    start_renderer(cmd->data, &in, -1);
+
+    /* A failing renderer shows in its exit status, 'pdf' stays open until
+       all renderers have finished */
+    feeder = pump_feeder(in);
+    pump_add_file(feeder, pdf->fd, 0, pdf->len);
+    pump_add_data(feeder, update->data, update->len);
+    pump_close(feeder);
+
+    free_dstr(update);
     return 1;
 }
 
 static int render_pages_with_generic_command(dstr_t *cmd,
+                                             pdf_file_t *pdf,
                                              const char *filename,
                                              int firstpage,
                                              int lastpage)
 {
     char tmpfile[PATH_MAX];
-    int result;
+    int fd;
 
     /* TODO it might be a good idea to give pdf command lines the possibility
      * to get the file on the command line rather than piped through stdin
      * (maybe introduce a &filename; ??) */
 
     if (lastpage < 0)  /* i.e. print the whole document */
-        dstrcatf(cmd, " < %s", filename);
-    else
     {
-        if (!pdf_extract_pages(tmpfile, filename, firstpage, lastpage))
-            rip_die(EXIT_STARVED, "Could not run ghostscript to extract the pages!\n");
-        dstrcatf(cmd, " < %s", tmpfile);
+        dstrcatf(cmd, " < %s", filename);
+        return start_renderer(cmd->data, NULL, -1);
     }
+    else if (pdf && render_page_subset(cmd, pdf, firstpage, lastpage))
+        return 1;
 
-    result = start_renderer(cmd->data);
-
-    if (lastpage > 0)
-        unlink(tmpfile);
+    fd = pdf_extract_pages(tmpfile, filename, firstpage, lastpage);
+    dstrcatf(cmd, " < %s", tmpfile);
 
-    return result;
+    /* The file gets closed when the renderer is done with it */
+    return start_renderer(cmd->data, NULL, fd);
 }
 
 static int render_pages_with_ghostscript(dstr_t *cmd,
@@ -172,7 +308,8 @@ static int render_pages_with_ghostscript(dstr_t *cmd,
                                          size_t end_gs_cmd,
                                          const char *filename,
                                          int firstpage,
-                                         int lastpage)
+                                         int lastpage,
+                                         const char *pagelist)
 {
     char *p;
 
@@ -187,7 +324,9 @@ static int render_pages_with_ghostscript(dstr_t *cmd,
 
     dstrinsertf(cmd, end_gs_cmd, " %s ", filename);
 
-    if (lastpage > 0)
+    if (pagelist)
+        dstrinsertf(cmd, start_gs_cmd +2, " -sPageList=%s ", pagelist);
+    else if (lastpage > 0)
         dstrinsertf(cmd, start_gs_cmd +2,
                     " -dFirstPage=%d -dLastPage=%d ",
                     firstpage, lastpage);
@@ -195,21 +334,76 @@ static int render_pages_with_ghostscript(dstr_t *cmd,
         dstrinsertf(cmd, start_gs_cmd +2,
                     " -dFirstPage=%d ", firstpage);
 
-    return start_renderer(cmd->data);
+    return start_renderer(cmd->data, NULL, -1);
+}
+
+/*
+ * Key for the output of rendering the pages 'first' through 'last', or the
+ * ones in 'pagelist': the PDF file, the command line, the PostScript option
+ * code and the JCL. Output which depends on data of the job (like &job; or
+ * &date; in the command line) is not cached.
+ */
+static int render_cache_key(int optset, dstr_t *cmd, int first, int last,
+                            const char *pagelist, char hex[65])
+{
+    cache_key_t key;
+    char pages[64];
+    char **line;
+    dstr_t *code;
+
+    if (isempty(input_digest) || optionset_uses_job_entities(optset, 1))
+        return 0;
+
+    cache_key_init(&key);
+    cache_key_add(&key, input_digest, 64);
+    cache_key_add(&key, cmd->data, cmd->len +1);
+    if (pagelist)
+        cache_key_add(&key, pagelist, strlen(pagelist) +1);
+    else {
+        snprintf(pages, 64, "%d-%d", first, last);
+        cache_key_add(&key, pages, strlen(pages) +1);
+    }
+    code = create_dstr();
+    get_option_code(code, optset);
+    cache_key_add(&key, code->data, code->len +1);
+    free_dstr(code);
+    if (jclprepend)
+        for (line = jclprepend; *line; line++)
+            cache_key_add(&key, *line, strlen(*line) +1);
+    cache_key_add(&key, jclappend->data, jclappend->len +1);
+    cache_key_final(&key, hex);
+    return 1;
 }
 
-static int render_pages(const char *filename, int firstpage, int lastpage)
+/*
+ * Render the pages 'firstpage' through 'lastpage' (-1 for the rest of the
+ * document), or, with Ghostscript, the ranges of pages in 'pagelist' if it
+ * is not NULL
+ */
+static int render_pages(int optset, pdf_file_t *pdf, const char *filename,
+                        int firstpage, int lastpage, const char *pagelist)
 {
     dstr_t *cmd = create_dstr();
     size_t start, end;
-    int result;
+    int result, cachefd;
+    char key[65];
 
-    build_commandline(optionset("currentpage"), cmd, 1);
+    build_commandline(optset, cmd, 1);
+
+    if (render_cache_key(optset, cmd, firstpage, lastpage, pagelist, key))
+    {
+        if ((cachefd = cache_lookup("out", key)) >= 0) {
+            free_dstr(cmd);
+            return launch_renderer(NULL, NULL, -1, cachefd);
+        }
+        render_entry = cache_store_begin("out", key);
+    }
 
     extract_command(&start, &end, cmd->data, "gs");
     if (start == end)
         /* command is not Ghostscript */
         result = render_pages_with_generic_command(cmd,
+                                                   pdf,
                                                    filename,
                                                    firstpage,
                                                    lastpage);
@@ -220,43 +414,152 @@ static int render_pages(const char *filename, int firstpage, int lastpage)
                                                end,
                                                filename,
                                                firstpage,
-                                               lastpage);
+                                               lastpage,
+                                               pagelist);
 
     free_dstr(cmd);
     return result;
 }
 
+/* Ghostscript 9.20 and newer render the ranges of pages given with
+   -sPageList, so that one renderer can take all pages of 'optset' */
+static int renders_page_list(int optset)
+{
+    dstr_t *cmd = create_dstr();
+    size_t start, end;
+
+    build_commandline(optset, cmd, 1);
+    extract_command(&start, &end, cmd->data, "gs");
+    free_dstr(cmd);
+    return start != end && gs_capabilities()->revision >= 920;
+}
+
+/* Render the run of pages 'firstpage' through 'lastpage', which holds
+   'count' pages. If not all of them are in it, the ranges of pages in it are
+   'pagelist' followed by 'rangestart' through 'lastpage'. */
+static void render_run(pdf_file_t *pdf, const char *filename, int page_count,
+                       int firstpage, int lastpage, int count,
+                       dstr_t *pagelist, int rangestart)
+{
+    if (count < lastpage - firstpage +1) {
+        if (rangestart < lastpage)
+            dstrcatf(pagelist, "%d-%d", rangestart, lastpage);
+        else
+            dstrcatf(pagelist, "%d", rangestart);
+        _log("Rendering pages %s\n", pagelist->data);
+        render_pages(optionset("previouspage"), pdf, filename, firstpage, lastpage, pagelist->data);
+    }
+    else if (firstpage == 1 && lastpage == page_count)
+        render_pages(optionset("previouspage"), pdf, filename, 1, -1, NULL); /* Render the whole document */
+    else
+        render_pages(optionset("previouspage"), pdf, filename, firstpage, lastpage, NULL);
+}
+
 static int print_pdf_file(const char *filename)
 {
     int page_count, i;
-    int firstpage;
-
-    page_count = pdf_count_pages(filename);
+    int firstpage, lastpage, rangestart, count, listed;
+    pdf_file_t *pdf = pdf_open(filename);
+    dstr_t *pagelist;
+    cache_key_t key;
+
+    page_count = pdf_count_pages(pdf, filename);
+
+    input_digest[0] = '\0';
+    if (cache_enabled()) {
+        cache_key_init(&key);
+        if (cache_key_add_file(&key, filename))
+            cache_key_final(&key, input_digest);
+    }
 
     if (page_count <= 0)
         rip_die(EXIT_JOBERR, "Unable to determine number of pages, page count: %d\n", page_count);
     _log("File contains %d pages\n", page_count);
 
-    optionset_copy_values(optionset("header"), optionset("currentpage"));
-    optionset_copy_values(optionset("currentpage"), optionset("previouspage"));
-    firstpage = 1;
+    /* Render runs of selected pages ("page-ranges" option) which have the
+       same command line and JCL options, each with the options of its
+       pages. Pages which are not selected end a run, unless Ghostscript
+       renders it and takes a list of pages. */
+    pagelist = create_dstr();
+    firstpage = lastpage = rangestart = count = listed = 0;
     for (i = 1; i <= page_count; i++)
     {
+        if (!page_selected(i))
+            continue;
+        optionset_copy_values(optionset("header"), optionset("currentpage"));
         set_options_for_page(optionset("currentpage"), i);
-        if (!optionset_equal(optionset("currentpage"), optionset("previouspage"), 1))
+        if (firstpage && ((lastpage < i -1 && !listed) ||
+                          !optionset_equal(optionset("currentpage"), optionset("previouspage"), 1)))
         {
-            render_pages(filename, firstpage, i);
-            firstpage = i;
+            render_run(pdf, filename, page_count, firstpage, lastpage, count, pagelist, rangestart);
+            firstpage = 0;
+        }
+        if (!firstpage) {
+            firstpage = rangestart = i;
+            count = 0;
+            dstrclear(pagelist);
+            listed = renders_page_list(optionset("currentpage"));
         }
+        else if (lastpage < i -1) {
+            /* a gap in a run which gets a list of pages */
+            if (rangestart < lastpage)
+                dstrcatf(pagelist, "%d-%d,", rangestart, lastpage);
+            else
+                dstrcatf(pagelist, "%d,", rangestart);
+            rangestart = i;
+        }
+        lastpage = i;
+        count++;
         optionset_copy_values(optionset("currentpage"), optionset("previouspage"));
     }
-    if (firstpage == 1)
-        render_pages(filename, 1, -1); /* Render the whole document */
+    if (firstpage)
+        render_run(pdf, filename, page_count, firstpage, lastpage, count, pagelist, rangestart);
     else
-        render_pages(filename, firstpage, page_count);
+        rip_die(EXIT_JOBERR, "None of the %d pages is selected by \"page-ranges=%s\"\n",
+                page_count, pageranges);
+    free_dstr(pagelist);
 
-    wait_for_renderer();
+    wait_for_renderers();
 
+    if (pdf)
+        pdf_close(pdf);
+    return 1;
+}
+
+/*
+ * Without options for certain pages and without page selection the whole
+ * document goes through one renderer, so the PDF data read from stdin can
+ * be streamed into it instead of being stored in a temporary file first.
+ */
+static int print_pdf_stream(const char *alreadyread, size_t len)
+{
+    dstr_t *cmd = create_dstr();
+    size_t start, end;
+    FILE *in;
+    char *p;
+
+    optionset_copy_values(optionset("header"), optionset("currentpage"));
+    build_commandline(optionset("currentpage"), cmd, 1);
+
+    /* Make Ghostscript read from stdin */
+    extract_command(&start, &end, cmd->data, "gs");
+    if (start != end) {
+        for (p = &cmd->data[end -1]; p > &cmd->data[start] && isspace(*p); p--)
+            ;
+        if (*p != '-' || !isspace(p[-1]))
+            dstrinsert(cmd, end, " - ");
+    }
+
+    _log("Streaming the PDF data into the renderer\n");
+    start_renderer(cmd->data, &in, -1);
+
+    if ((len && fwrite(alreadyread, len, 1, in) != 1) || fflush(in) != 0 ||
+        !copy_fd(pump_fileno(in), fileno(stdin)))
+        _log("Could not send the PDF data to the renderer\n");
+    fclose(in);
+
+    wait_for_renderers();
+    free_dstr(cmd);
     return 1;
 }
 
@@ -266,35 +569,253 @@ int print_pdf(FILE *s,
               const char *filename,
               size_t startpos)
 {
-    char tmpfilename[PATH_MAX] = "";
-    int result;
+    char tmpfilename[PATH_MAX];
+    int result, fd = -1;
+
+    if (s == stdin && isempty(pageranges) && !page_specific_options())
+        return print_pdf_stream(alreadyread, len);
 
-    /* If reading from stdin, write everything into a temporary file */
-    /* TODO don't do this if there aren't any pagerange-limited options */
+    /* Otherwise the pages have to be counted and rendered in groups, so when
+       reading from stdin, write everything into a temporary file */
     if (s == stdin)
     {
-        int fd;
-        FILE *tmpfile;
-
-        snprintf(tmpfilename, PATH_MAX, "%s/foomatic-XXXXXX", temp_dir());
-        fd = mkstemp(tmpfilename);
-        if (fd < 0) {
-            _log("Could not create temporary file: %s\n", strerror(errno));
+        if ((fd = spool_to_temp_file(fileno(stdin), alreadyread, len)) < 0)
             return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-        }
-
-        tmpfile = fdopen(fd, "r+");
-        copy_file(tmpfile, stdin, alreadyread, len);
-        fclose(tmpfile);
-
-        filename = tmpfilename;
+        filename = fd_path(fd, tmpfilename);
     }
 
     result = print_pdf_file(filename);
 
-    if (!isempty(tmpfilename))
-        unlink(tmpfilename);
+    if (fd >= 0)
+        close(fd);
 
     return result;
 }
 
+
+/*
+ * Conversion to PostScript in chunks of pages
+ *
+ * Every chunk gets converted by its own Ghostscript (or pdftops), all of
+ * them at the same time. The outputs are merged into one DSC-conforming
+ * document: the header, prolog and setup of the first chunk are the ones of
+ * the document, those of the later chunks (and the trailer of the chunk
+ * before) go into their first page, with the DSC comments in them turned
+ * into normal comments. The pages get numbered through.
+ *
+ * A chunk is merged when its converter has finished, so nothing goes out
+ * before the first chunk is complete. Until then the output of a chunk is
+ * kept in a spill file, which moves to disk beyond temp_memory_limit.
+ */
+
+#define MAX_CHUNKS 16
+#define MIN_CHUNK_PAGES 4
+
+typedef struct pdf_chunk {
+    int first, last;
+    spillfile_t out;        /* PostScript output */
+    pid_t pid;
+} pdf_chunk_t;
+
+static pdf_chunk_t chunks[MAX_CHUNKS];
+static int chunk_count, chunk_total_pages;
+static const char *chunk_filename;
+
+/* Run 'argv' with the messages on stderr thrown away, the shell's
+   "2>/dev/null" */
+static void exec_quiet(char **argv)
+{
+    int fd;
+
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+        dup2(fd, fileno(stderr));
+        close(fd);
+    }
+    execvp(argv[0], argv);
+}
+
+/* Run 'argv' with its output going into 'sf'. Returns 1 if it succeeded. */
+static int run_into_spillfile(char **argv, spillfile_t *sf)
+{
+    int pfd[2], status, ok, i;
+    pid_t pid;
+
+    if (pipe2(pfd, O_CLOEXEC) != 0)
+        return 0;
+    if ((pid = fork()) == 0) {
+        dup2(pfd[1], fileno(stdout));
+        for (i = 0; argv[i]; i++)
+            inherit_fd_paths(argv[i], 1);
+        exec_quiet(argv);
+        _exit(127);
+    }
+    close(pfd[1]);
+    ok = pid > 0 && spillfromfd(sf, pfd[0]);
+    close(pfd[0]);
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return 0;
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Convert the pages of one chunk with Ghostscript, or with pdftops if that
+   fails. The commands are run without a shell, so that the file name does
+   not need any quoting. */
+static int exec_chunk(FILE *in, FILE *out, void *user_arg)
+{
+    pdf_chunk_t *chunk = (pdf_chunk_t *)user_arg;
+    char firstpage[32], lastpage[32], first[16], last[16];
+    char *gsargv[] = { gspath, "-q", "-sstdout=%stderr", "-sDEVICE=ps2write",
+                       "-sOutputFile=-", "-dBATCH", "-dNOPAUSE",
+                       "-dPARANOIDSAFER", "-dNOINTERPOLATE", firstpage,
+                       lastpage, (char *)chunk_filename, NULL };
+    char *pdftopsargv[] = { "pdftops", "-level2", "-origpagesizes",
+                            "-f", first, "-l", last,
+                            (char *)chunk_filename, "-", NULL };
+
+    snprintf(firstpage, sizeof(firstpage), "-dFirstPage=%d", chunk->first);
+    snprintf(lastpage, sizeof(lastpage), "-dLastPage=%d", chunk->last);
+    snprintf(first, sizeof(first), "%d", chunk->first);
+    snprintf(last, sizeof(last), "%d", chunk->last);
+
+    if (run_into_spillfile(gsargv, &chunk->out))
+        return EXIT_PRINTED;
+
+    /* pdftops starts over, nothing of the failed Ghostscript run stays */
+    spillclear(&chunk->out);
+    if (run_into_spillfile(pdftopsargv, &chunk->out))
+        return EXIT_PRINTED;
+    return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+}
+
+/* Append the 'len' bytes of 'line' to 'ds' so that it does not count as
+   DSC comment anymore */
+static void add_embedded_line(dstr_t *ds, const char *line, size_t len)
+{
+    if (startswith(line, "%%") &&
+        !startswith(line, "%%BeginData") && !startswith(line, "%%EndData") &&
+        !startswith(line, "%%BeginBinary") && !startswith(line, "%%EndBinary"))
+        dstrcat(ds, "%");
+    dstrncat(ds, line, len);
+}
+
+/* The lines are not zero-terminated strings, binary data in the output of
+   the converters can contain NUL bytes */
+static void merge_chunk(FILE *out, FILE *in, int idx, int *page, dstr_t *embedded)
+{
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    int inheader = 1, intrailer = 0, nesting = 0;
+
+    while ((len = getline(&line, &linesize, in)) > 0)
+    {
+        if (startswith(line, "%%BeginDocument"))
+            nesting++;
+        else if (startswith(line, "%%EndDocument") && nesting)
+            nesting--;
+
+        if (!nesting && startswith(line, "%%Page:")) {
+            *page += 1;
+            fprintf(out, "%%%%Page: %d %d\n", *page, *page);
+            if (embedded->len) {
+                fwrite(embedded->data, embedded->len, 1, out);
+                dstrclear(embedded);
+            }
+            inheader = 0;
+        }
+        else if (intrailer) {
+            if (!startswith(line, "%%EOF"))
+                add_embedded_line(embedded, line, len);
+        }
+        else if (inheader && idx > 0)
+            add_embedded_line(embedded, line, len);
+        else if (!nesting && startswith(line, "%%Trailer") && idx < chunk_count -1) {
+            add_embedded_line(embedded, line, len);
+            intrailer = 1;
+        }
+        else if (!nesting && startswith(line, "%%Pages:"))
+            fprintf(out, "%%%%Pages: %d\n", chunk_total_pages);
+        else
+            fwrite(line, len, 1, out);
+    }
+    free(line);
+}
+
+static int exec_pdf_to_ps_chunks(FILE *in, FILE *out, void *user_arg)
+{
+    dstr_t *embedded = create_dstr();
+    pdf_chunk_t *chunk;
+    int i, status, page = 0;
+    FILE *f;
+
+    for (i = 0; i < chunk_count; i++) {
+        chunk = &chunks[i];
+        if (!create_spillfile(&chunk->out))
+            goto error;
+        _log("Converting pages %d through %d to PostScript\n",
+             chunk->first, chunk->last);
+        if ((chunk->pid = start_process("pdf-to-ps", exec_chunk, chunk, NULL, NULL)) < 0)
+            goto error;
+    }
+
+    for (i = 0; i < chunk_count; i++) {
+        chunk = &chunks[i];
+        status = wait_for_process(chunk->pid);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            _log("Could not convert pages %d through %d to PostScript\n",
+                 chunk->first, chunk->last);
+            goto error;
+        }
+
+        if (!(f = fdopen(spillfinish(&chunk->out), "r")))
+            goto error;
+        merge_chunk(out, f, i, &page, embedded);
+        fclose(f);
+    }
+
+    free_dstr(embedded);
+    if (fclose(out) != 0)
+        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+    return EXIT_PRINTED;
+
+error:
+    kill_all_processes();
+    free_dstr(embedded);
+    return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+}
+
+pid_t start_pdf_to_ps_chunks(const char *filename, FILE **out)
+{
+    pdf_file_t *pdf;
+    int pages, n, i;
+    pid_t pid;
+
+    if (pdf_convert_chunks < 2 || !(pdf = pdf_open(filename)))
+        return 0;
+    pages = pdf_page_count(pdf);
+    pdf_close(pdf);
+
+    n = pdf_convert_chunks < MAX_CHUNKS ? pdf_convert_chunks : MAX_CHUNKS;
+    if (pages / MIN_CHUNK_PAGES < n)
+        n = pages / MIN_CHUNK_PAGES;
+    if (n < 2)
+        return 0;
+
+    chunk_filename = filename;
+    chunk_total_pages = pages;
+    chunk_count = 0;
+    for (i = 1; i <= pages; i += (pages + n -1) / n) {
+        pdf_chunk_t *chunk = &chunks[chunk_count++];
+
+        chunk->first = i;
+        chunk->last = i + (pages + n -1) / n -1;
+        if (chunk->last > pages)
+            chunk->last = pages;
+    }
+
+    _log("Converting the PDF file to PostScript in %d chunks\n", chunk_count);
+    pid = start_process("pdf-to-ps", exec_pdf_to_ps_chunks, NULL, NULL, out);
+    if (pid < 0)
+        return 0;
+    return pid;
+}
@@ -24,7 +24,14 @@
 #ifndef pdf_h
 #define pdf_h
 
+#include <stdio.h>
+#include <sys/types.h>
+
 int print_pdf(FILE *s, const char *alreadyread, size_t len, const char *filename, int startpos);
 
+/* Start converting the PDF file to PostScript in chunks of pages, the
+   PostScript comes out of 'out'. Returns 0 if the file is not split. */
+pid_t start_pdf_to_ps_chunks(const char *filename, FILE **out);
+
 #endif
 
@@ -0,0 +1,1060 @@
+/* pdfparser.c
+ *
+ * This file is part of foomatic-rip.
+ *
+ * Foomatic-rip is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Foomatic-rip is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "foomaticrip.h"
+#include "util.h"
+#include "pdfparser.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+
+/* Limits against damaged files */
+#define PDF_MAX_OBJECTS 8000000
+#define PDF_MAX_XREF_SECTIONS 64
+#define PDF_MAX_NESTING 64
+
+enum pdf_xref_type {
+    XREF_UNUSED = 0,        /* not found yet (or free) */
+    XREF_OFFSET,            /* object at 'offset' in the file, generation
+                               number in 'index' */
+    XREF_COMPRESSED         /* 'index'th object of object stream 'offset' */
+};
+
+struct pdf_xref_entry {
+    enum pdf_xref_type type;
+    int index;
+    size_t offset;
+};
+
+struct pdf_objstm {
+    int num;
+    char *data;
+    size_t len;
+    int n;
+    size_t *offsets;        /* of the 'n' objects, relative to 'data' */
+    struct pdf_objstm *next;
+};
+
+
+static int is_pdf_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\0';
+}
+
+static int is_pdf_delimiter(char c)
+{
+    return c && strchr("()<>[]{}/%", c) != NULL;
+}
+
+/* Skip white space and comments */
+static const char * skip_space(const char *p, const char *end)
+{
+    while (p < end) {
+        if (is_pdf_space(*p))
+            p++;
+        else if (*p == '%') {
+            while (p < end && *p != '\r' && *p != '\n')
+                p++;
+        }
+        else
+            break;
+    }
+    return p;
+}
+
+/* Skip a number, a keyword or the characters of a name after the '/' */
+static const char * skip_token(const char *p, const char *end)
+{
+    while (p < end && !is_pdf_space(*p) && !is_pdf_delimiter(*p))
+        p++;
+    return p;
+}
+
+/* Does the keyword 'kw' start at 'p'? */
+static int is_keyword(const char *p, const char *end, const char *kw)
+{
+    size_t len = strlen(kw);
+    return (size_t)(end - p) >= len && !memcmp(p, kw, len) &&
+        (skip_token(p, end) == p + len);
+}
+
+/* Does the name "/<name>" start at 'p'? */
+static int is_name(const char *p, const char *end, const char *name)
+{
+    return p < end && *p == '/' && is_keyword(p +1, end, name);
+}
+
+static const char * parse_int(const char *p, const char *end, long long *val)
+{
+    int neg = 0;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    if (p >= end || *p < '0' || *p > '9')
+        return NULL;
+
+    *val = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (*val > LLONG_MAX / 10)
+            return NULL;
+        *val = *val * 10 + (*p++ - '0');
+    }
+    if (neg)
+        *val = -*val;
+    return p;
+}
+
+/* Parse "<num> <gen> R" or "<num> <gen> obj" (keyword 'kw'), returns the
+   position after the keyword */
+static const char * parse_objref(const char *p, const char *end, const char *kw,
+                                 int *num, int *gen)
+{
+    long long n, g;
+
+    if (!(p = parse_int(p, end, &n)) || p >= end || !is_pdf_space(*p))
+        return NULL;
+    p = skip_space(p, end);
+    if (!(p = parse_int(p, end, &g)) || p >= end || !is_pdf_space(*p))
+        return NULL;
+    p = skip_space(p, end);
+    if (!is_keyword(p, end, kw) || n < 0 || n > INT_MAX || g < 0 || g > INT_MAX)
+        return NULL;
+    *num = n;
+    *gen = g;
+    return p + strlen(kw);
+}
+
+static const char * _skip_value(const char *p, const char *end, int depth)
+{
+    int num, gen, parens;
+    const char *q;
+
+    p = skip_space(p, end);
+    if (p >= end || depth > PDF_MAX_NESTING)
+        return NULL;
+
+    switch (*p) {
+        case '/':
+            return skip_token(p +1, end);
+
+        case '(':
+            for (parens = 0, p++; p < end; p++) {
+                if (*p == '\\')
+                    p++;
+                else if (*p == '(')
+                    parens++;
+                else if (*p == ')' && parens-- == 0)
+                    return p +1;
+            }
+            return NULL;
+
+        case '<':
+            if (p +1 < end && p[1] == '<') {
+                /* Dictionary, keys and values alternate */
+                for (p += 2; ; ) {
+                    p = skip_space(p, end);
+                    if (p +1 < end && p[0] == '>' && p[1] == '>')
+                        return p + 2;
+                    if (!(p = _skip_value(p, end, depth +1)))
+                        return NULL;
+                }
+            }
+            q = memchr(p, '>', end - p);
+            return q ? q +1 : NULL;
+
+        case '[':
+            for (p++; ; ) {
+                p = skip_space(p, end);
+                if (p < end && *p == ']')
+                    return p +1;
+                if (!(p = _skip_value(p, end, depth +1)))
+                    return NULL;
+            }
+
+        case ']':
+        case '>':
+        case ')':
+        case '{':
+        case '}':
+            return NULL;
+    }
+
+    /* Indirect reference, number or keyword */
+    if ((q = parse_objref(p, end, "R", &num, &gen)))
+        return q;
+    q = skip_token(p, end);
+    return q > p ? q : NULL;
+}
+
+/* Position after the object (dictionary, array, ...) starting at 'p' */
+static const char * skip_value(const char *p, const char *end)
+{
+    return _skip_value(p, end, 0);
+}
+
+/* Next entry of a dictionary, 'p' is after the "<<" or after the value of
+   the previous entry. Returns the position after the value, NULL at the
+   end of the dictionary. */
+static const char * dict_next(const char *p, const char *end,
+                              const char **key, size_t *keylen, const char **val)
+{
+    p = skip_space(p, end);
+    if (p >= end || *p != '/')
+        return NULL;
+    *key = ++p;
+    p = skip_token(p, end);
+    *keylen = p - *key;
+    *val = skip_space(p, end);
+    return skip_value(*val, end);
+}
+
+/* Look up 'key' (without the '/') in the dictionary at 'dict', returns the
+   beginning of its value or NULL */
+static const char * dict_get(const char *dict, const char *end, const char *key)
+{
+    const char *p = skip_space(dict, end), *name, *val;
+    size_t keylen = strlen(key), namelen;
+
+    if (end - p < 2 || p[0] != '<' || p[1] != '<')
+        return NULL;
+
+    for (p += 2; (p = dict_next(p, end, &name, &namelen, &val)); ) {
+        if (namelen == keylen && !memcmp(name, key, keylen))
+            return val;
+    }
+    return NULL;
+}
+
+static int is_dict(const char *p, const char *end)
+{
+    return p && end - p >= 2 && p[0] == '<' && p[1] == '<';
+}
+
+/* Object 'num', returns the beginning of its value. 'end' is set to the end
+   of the data containing it. */
+static const char * pdf_object(pdf_file_t *pdf, int num, const char **end);
+
+/* Integer value at 'p', which may be an indirect reference */
+static int get_int(pdf_file_t *pdf, const char *p, const char *end, long long *val)
+{
+    int num, gen;
+
+    if (!p)
+        return 0;
+    if (parse_objref(p, end, "R", &num, &gen)) {
+        if (!(p = pdf_object(pdf, num, &end)))
+            return 0;
+    }
+    return parse_int(p, end, val) != NULL;
+}
+
+static int dict_get_int(pdf_file_t *pdf, const char *dict, const char *end,
+                        const char *key, long long *val)
+{
+    return get_int(pdf, dict_get(dict, end, key), end, val);
+}
+
+/* Resolve an indirect reference to a dictionary */
+static const char * get_dict(pdf_file_t *pdf, const char *p, const char *end,
+                             const char **dictend)
+{
+    int num, gen;
+
+    *dictend = end;
+    if (p && parse_objref(p, end, "R", &num, &gen))
+        p = pdf_object(pdf, num, dictend);
+    return is_dict(p, *dictend) ? p : NULL;
+}
+
+
+#ifdef HAVE_LIBZ
+static char * flate_decode(const char *in, size_t inlen, size_t *outlen)
+{
+    z_stream z;
+    size_t alloc = inlen * 4 + 1024;
+    char *out;
+    int ret;
+
+    if (inlen > UINT_MAX)
+        return NULL;
+
+    memset(&z, 0, sizeof(z));
+    if (inflateInit(&z) != Z_OK)
+        return NULL;
+    out = malloc(alloc);
+    z.next_in = (Bytef *)in;
+    z.avail_in = inlen;
+
+    for (;;) {
+        if (z.total_out == alloc) {
+            if (alloc > UINT_MAX / 2)
+                break;
+            alloc *= 2;
+            out = realloc(out, alloc);
+        }
+        z.next_out = (Bytef *)&out[z.total_out];
+        z.avail_out = alloc - z.total_out;
+
+        ret = inflate(&z, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            break;
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || (z.avail_out && !z.avail_in)) {
+            /* Damaged or truncated stream, use what we got */
+            if (z.total_out == 0) {
+                inflateEnd(&z);
+                free(out);
+                return NULL;
+            }
+            break;
+        }
+    }
+
+    *outlen = z.total_out;
+    inflateEnd(&z);
+    return out;
+}
+#endif
+
+/* Undo a PNG predictor (/Predictor 10 to 15), 'data' is changed in place */
+static int png_unpredict(char *data, size_t *len, int columns, int colors, int bpc)
+{
+    size_t bpp = (colors * bpc + 7) / 8, rowlen = ((size_t)columns * colors * bpc + 7) / 8;
+    size_t in = 0, out = 0, i;
+    unsigned char *row, *cur, *prev;
+    int left, up, upleft, pa, pb, pc, pred;
+    unsigned char type;
+
+    if (bpp == 0 || rowlen == 0)
+        return 0;
+
+    prev = calloc(rowlen, 1);
+    row = malloc(rowlen);
+
+    while (in + rowlen + 1 <= *len) {
+        type = data[in];
+        memcpy(row, &data[in +1], rowlen);
+        cur = (unsigned char *)&data[out];
+
+        for (i = 0; i < rowlen; i++) {
+            left = i >= bpp ? cur[i - bpp] : 0;
+            up = prev[i];
+            upleft = i >= bpp ? prev[i - bpp] : 0;
+            switch (type) {
+                case 0: pred = 0; break;
+                case 1: pred = left; break;
+                case 2: pred = up; break;
+                case 3: pred = (left + up) / 2; break;
+                case 4:
+                    pa = abs(up - upleft);
+                    pb = abs(left - upleft);
+                    pc = abs(left + up - 2 * upleft);
+                    pred = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : upleft);
+                    break;
+                default:
+                    free(prev);
+                    free(row);
+                    return 0;
+            }
+            cur[i] = row[i] + pred;
+        }
+        memcpy(prev, cur, rowlen);
+        in += rowlen + 1;
+        out += rowlen;
+    }
+
+    free(prev);
+    free(row);
+    *len = out;
+    return 1;
+}
+
+/* Decoded data of the stream whose dictionary starts at 'dict', only
+   unfiltered and FlateDecode streams are supported */
+static char * pdf_stream_data(pdf_file_t *pdf, const char *dict, const char *end, size_t *len)
+{
+    const char *p, *filter, *parms, *parmsend;
+    long long length, predictor = 1, columns = 1, colors = 1, bpc = 8;
+    char *data;
+
+    if (!(p = skip_value(dict, end)))
+        return NULL;
+    p = skip_space(p, end);
+    if (!is_keyword(p, end, "stream"))
+        return NULL;
+    p += 6;
+    if (p < end && *p == '\r')
+        p++;
+    if (p < end && *p == '\n')
+        p++;
+
+    if (!dict_get_int(pdf, dict, end, "Length", &length) ||
+        length < 0 || length > pdf->data + pdf->len - p)
+        return NULL;
+
+    if ((filter = dict_get(dict, end, "Filter")) && *filter == '[') {
+        filter = skip_space(filter +1, end);
+        if (*filter == ']')
+            filter = NULL;
+        else if (*skip_space(skip_value(filter, end) ?: end, end) != ']')
+            return NULL;    /* several filters */
+    }
+
+    if (!filter) {
+        data = malloc(length +1);
+        memcpy(data, p, length);
+        *len = length;
+    }
+#ifdef HAVE_LIBZ
+    else if (is_name(filter, end, "FlateDecode")) {
+        if (!(data = flate_decode(p, length, len)))
+            return NULL;
+    }
+#endif
+    else
+        return NULL;
+
+    /* Predictor for the Flate filter */
+    if ((parms = dict_get(dict, end, "DecodeParms")) && *parms == '[')
+        parms = skip_space(parms +1, end);
+    if (filter && (parms = get_dict(pdf, parms, end, &parmsend))) {
+        dict_get_int(pdf, parms, parmsend, "Predictor", &predictor);
+        dict_get_int(pdf, parms, parmsend, "Columns", &columns);
+        dict_get_int(pdf, parms, parmsend, "Colors", &colors);
+        dict_get_int(pdf, parms, parmsend, "BitsPerComponent", &bpc);
+    }
+    if (predictor >= 10) {
+        if (columns < 1 || columns > 65536 || colors < 1 || colors > 32 ||
+            bpc < 1 || bpc > 16 || !png_unpredict(data, len, columns, colors, bpc)) {
+            free(data);
+            return NULL;
+        }
+    }
+    else if (predictor != 1) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+
+static int ensure_xref_size(pdf_file_t *pdf, long long size)
+{
+    if (size < 0 || size > PDF_MAX_OBJECTS)
+        return 0;
+    if (size > pdf->xrefsize) {
+        pdf->xref = realloc(pdf->xref, size * sizeof(pdf_xref_entry_t));
+        memset(&pdf->xref[pdf->xrefsize], 0, (size - pdf->xrefsize) * sizeof(pdf_xref_entry_t));
+        pdf->xrefsize = size;
+    }
+    return 1;
+}
+
+/* Newer sections are read first, so only entries not found yet are set */
+static void set_xref_entry(pdf_file_t *pdf, long long num, enum pdf_xref_type type,
+                           size_t offset, int index)
+{
+    if (num < 0 || num >= pdf->xrefsize || pdf->xref[num].type != XREF_UNUSED)
+        return;
+    pdf->xref[num].type = type;
+    pdf->xref[num].offset = offset;
+    pdf->xref[num].index = index;
+}
+
+static int read_xref_section(pdf_file_t *pdf, long long offset, int depth);
+
+/* Handle the trailer keys of a cross-reference section, 'dict' is the
+   trailer dictionary or the dictionary of the cross-reference stream */
+static int read_trailer(pdf_file_t *pdf, const char *dict, const char *end, int depth)
+{
+    const char *p, *q;
+    long long prev;
+
+    if (dict_get(dict, end, "Encrypt")) {
+        _log("PDF file is encrypted\n");
+        return 0;
+    }
+    if (!pdf->rootnum &&
+        !parse_objref(dict_get(dict, end, "Root") ?: end, end, "R", &pdf->rootnum, &pdf->rootgen))
+        return 0;
+    if (!pdf->info && (p = dict_get(dict, end, "Info")) && (q = skip_value(p, end))) {
+        pdf->info = p;
+        pdf->infolen = q - p;
+    }
+    if (!pdf->id && (p = dict_get(dict, end, "ID")) && (q = skip_value(p, end))) {
+        pdf->id = p;
+        pdf->idlen = q - p;
+    }
+
+    /* Hybrid files: the cross-reference stream comes before older sections */
+    if (dict_get_int(pdf, dict, end, "XRefStm", &prev) &&
+        !read_xref_section(pdf, prev, depth +1))
+        return 0;
+    if (dict_get_int(pdf, dict, end, "Prev", &prev))
+        return read_xref_section(pdf, prev, depth +1);
+    return 1;
+}
+
+static int read_xref_table(pdf_file_t *pdf, const char *p, const char *end, int depth)
+{
+    long long start, count, offset, gen, i;
+
+    for (;;) {
+        p = skip_space(p, end);
+        if (is_keyword(p, end, "trailer"))
+            break;
+        if (!(p = parse_int(p, end, &start)))
+            return 0;
+        p = skip_space(p, end);
+        if (!(p = parse_int(p, end, &count)) ||
+            !ensure_xref_size(pdf, start + count))
+            return 0;
+        for (i = start; i < start + count; i++) {
+            p = skip_space(p, end);
+            if (!(p = parse_int(p, end, &offset)))
+                return 0;
+            p = skip_space(p, end);
+            if (!(p = parse_int(p, end, &gen)))
+                return 0;
+            p = skip_space(p, end);
+            if (p >= end || (*p != 'n' && *p != 'f'))
+                return 0;
+            /* Free entries are not recorded, in hybrid files they hide
+               objects which are in object streams */
+            if (*p++ == 'n' && gen <= 65535)
+                set_xref_entry(pdf, i, XREF_OFFSET, offset, gen);
+        }
+    }
+    p = skip_space(p + 7, end);
+    return is_dict(p, end) && read_trailer(pdf, p, end, depth);
+}
+
+static int read_xref_stream(pdf_file_t *pdf, const char *dict, const char *end, int depth)
+{
+    const char *p, *index;
+    long long w[3], size, start, count, field[3];
+    size_t len, pos, rowlen;
+    char *data;
+    int i, k;
+
+    if (!(p = dict_get(dict, end, "Type")) || !is_name(p, end, "XRef") ||
+        !dict_get_int(pdf, dict, end, "Size", &size) || !ensure_xref_size(pdf, size))
+        return 0;
+
+    if (!(p = dict_get(dict, end, "W")) || *p++ != '[')
+        return 0;
+    for (i = 0, rowlen = 0; i < 3; i++) {
+        p = skip_space(p, end);
+        if (!(p = parse_int(p, end, &w[i])) || w[i] < 0 || w[i] > 8)
+            return 0;
+        rowlen += w[i];
+    }
+    if (!rowlen || !(data = pdf_stream_data(pdf, dict, end, &len)))
+        return 0;
+
+    if ((index = dict_get(dict, end, "Index")) && *index == '[')
+        index++;
+    else
+        index = NULL;
+
+    pos = 0;
+    do {
+        if (index) {
+            index = skip_space(index, end);
+            if (*index == ']')
+                break;
+            if (!(index = parse_int(index, end, &start)))
+                break;
+            index = skip_space(index, end);
+            if (!(index = parse_int(index, end, &count)))
+                break;
+        }
+        else {
+            start = 0;
+            count = size;
+        }
+
+        for (; count > 0 && pos + rowlen <= len; count--, start++) {
+            for (i = 0; i < 3; i++) {
+                field[i] = 0;
+                for (k = 0; k < w[i]; k++)
+                    field[i] = (field[i] << 8) | (unsigned char)data[pos++];
+            }
+            if (w[0] == 0)
+                field[0] = 1;   /* default type */
+            if (field[0] == 1)
+                set_xref_entry(pdf, start, XREF_OFFSET, field[1], field[2] & 0xffff);
+            else if (field[0] == 2)
+                set_xref_entry(pdf, start, XREF_COMPRESSED, field[1], field[2]);
+        }
+    } while (index);
+
+    free(data);
+    return read_trailer(pdf, dict, end, depth);
+}
+
+/* Read the cross-reference section at 'offset' and all older ones */
+static int read_xref_section(pdf_file_t *pdf, long long offset, int depth)
+{
+    const char *p, *end = pdf->data + pdf->len;
+    int num, gen;
+
+    if (offset < 0 || (size_t)offset >= pdf->len || depth > PDF_MAX_XREF_SECTIONS)
+        return 0;
+
+    p = skip_space(pdf->data + offset, end);
+    if (is_keyword(p, end, "xref"))
+        return read_xref_table(pdf, p + 4, end, depth);
+    if ((p = parse_objref(p, end, "obj", &num, &gen))) {
+        if (depth == 0)
+            pdf->xrefstream = 1;
+        return read_xref_stream(pdf, skip_space(p, end), end, depth);
+    }
+    return 0;
+}
+
+
+static pdf_objstm_t * load_objstm(pdf_file_t *pdf, int num)
+{
+    pdf_objstm_t *os;
+    const char *dict, *end, *p, *objend;
+    long long n, first, objnum, offset;
+    int i;
+
+    for (os = pdf->objstms; os; os = os->next)
+        if (os->num == num)
+            return os;
+
+    /* Object streams cannot be in object streams themselves */
+    if (num < 0 || num >= pdf->xrefsize || pdf->xref[num].type != XREF_OFFSET ||
+        !(dict = pdf_object(pdf, num, &end)) || !is_dict(dict, end) ||
+        !dict_get_int(pdf, dict, end, "N", &n) || !dict_get_int(pdf, dict, end, "First", &first) ||
+        n < 0 || n > PDF_MAX_OBJECTS || first < 0)
+        return NULL;
+
+    os = malloc(sizeof(pdf_objstm_t));
+    os->num = num;
+    os->n = n;
+    os->offsets = malloc((n ? n : 1) * sizeof(size_t));
+    if (!(os->data = pdf_stream_data(pdf, dict, end, &os->len)) || (size_t)first > os->len) {
+        free(os->data);
+        free(os->offsets);
+        free(os);
+        return NULL;
+    }
+
+    p = os->data;
+    objend = os->data + os->len;
+    for (i = 0; i < n; i++) {
+        p = skip_space(p, objend);
+        if (!(p = parse_int(p, objend, &objnum)))
+            break;
+        p = skip_space(p, objend);
+        if (!(p = parse_int(p, objend, &offset)) || offset < 0 ||
+            (size_t)(first + offset) >= os->len)
+            break;
+        os->offsets[i] = first + offset;
+    }
+    os->n = i;
+
+    os->next = pdf->objstms;
+    pdf->objstms = os;
+    return os;
+}
+
+static const char * pdf_object(pdf_file_t *pdf, int num, const char **end)
+{
+    pdf_xref_entry_t *e;
+    pdf_objstm_t *os;
+    const char *p;
+    int n, gen;
+
+    if (num <= 0 || num >= pdf->xrefsize)
+        return NULL;
+    e = &pdf->xref[num];
+
+    if (e->type == XREF_OFFSET) {
+        if (e->offset >= pdf->len)
+            return NULL;
+        *end = pdf->data + pdf->len;
+        p = skip_space(pdf->data + e->offset, *end);
+        if (!(p = parse_objref(p, *end, "obj", &n, &gen)) || n != num)
+            return NULL;
+        return skip_space(p, *end);
+    }
+    else if (e->type == XREF_COMPRESSED) {
+        if (e->offset > INT_MAX || !(os = load_objstm(pdf, e->offset)) ||
+            e->index < 0 || e->index >= os->n)
+            return NULL;
+        *end = os->data + os->len;
+        return skip_space(os->data + os->offsets[e->index], *end);
+    }
+    return NULL;
+}
+
+
+/* Find the last "startxref" in the file */
+static long long find_startxref(pdf_file_t *pdf)
+{
+    const char *p, *end = pdf->data + pdf->len;
+    long long offset;
+    size_t tail = pdf->len < 4096 ? pdf->len : 4096;
+
+    for (p = end - 9; p >= end - tail; p--) {
+        if (!memcmp(p, "startxref", 9)) {
+            p = skip_space(p + 9, end);
+            return parse_int(p, end, &offset) ? offset : -1;
+        }
+    }
+    return -1;
+}
+
+pdf_file_t * pdf_open(const char *filename)
+{
+    pdf_file_t *pdf;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 16 ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    pdf = calloc(1, sizeof(pdf_file_t));
+    pdf->fd = fd;
+    pdf->data = map;
+    pdf->len = st.st_size;
+
+    pdf->startxref = find_startxref(pdf);
+    if (!read_xref_section(pdf, pdf->startxref, 0) || !pdf->rootnum) {
+        _log("Could not read the cross-reference table of %s\n", filename);
+        pdf_close(pdf);
+        return NULL;
+    }
+    return pdf;
+}
+
+void pdf_close(pdf_file_t *pdf)
+{
+    pdf_objstm_t *os;
+
+    while ((os = pdf->objstms)) {
+        pdf->objstms = os->next;
+        free(os->data);
+        free(os->offsets);
+        free(os);
+    }
+    free(pdf->xref);
+    munmap((void *)pdf->data, pdf->len);
+    close(pdf->fd);
+    free(pdf);
+}
+
+int pdf_page_count(pdf_file_t *pdf)
+{
+    const char *catalog, *pages, *end, *pagesend;
+    long long count;
+
+    if (!(catalog = pdf_object(pdf, pdf->rootnum, &end)) || !is_dict(catalog, end) ||
+        !(pages = get_dict(pdf, dict_get(catalog, end, "Pages"), end, &pagesend)) ||
+        !dict_get_int(pdf, pages, pagesend, "Count", &count) ||
+        count <= 0 || count > INT_MAX)
+        return -1;
+    return count;
+}
+
+
+/* Attributes which pages inherit from their ancestors in the page tree */
+static const char *inheritable[] = { "Resources", "MediaBox", "CropBox", "Rotate" };
+#define INHERITABLE_COUNT 4
+
+typedef struct {
+    const char *val[INHERITABLE_COUNT];
+    size_t len[INHERITABLE_COUNT];
+} inherited_t;
+
+typedef struct {
+    int num;
+    int gen;
+    size_t offset;
+} subset_entry_t;
+
+typedef struct {
+    int first, last;
+    int pageno;             /* pages of the tree seen so far */
+    int nodes;              /* nodes visited, against loops in the tree */
+    int pagecount;          /* pages in the subset */
+    int newroot;            /* object number of the new page tree */
+    size_t base;            /* file offset where 'out' gets appended */
+    dstr_t *out;
+    dstr_t *kids;
+    subset_entry_t *entries;
+    int count, alloc;
+} subset_t;
+
+/* Start a new object in the update */
+static void subset_begin_object(subset_t *sub, int num, int gen)
+{
+    if (sub->count == sub->alloc) {
+        sub->alloc = sub->alloc ? sub->alloc * 2 : 64;
+        sub->entries = realloc(sub->entries, sub->alloc * sizeof(subset_entry_t));
+    }
+    sub->entries[sub->count].num = num;
+    sub->entries[sub->count].gen = gen;
+    sub->entries[sub->count].offset = sub->base + sub->out->len;
+    sub->count++;
+    dstrcatf(sub->out, "%d %d obj\n<<", num, gen);
+}
+
+/* Copy the entries of the dictionary at 'dict', except the one for 'skip' */
+static void copy_dict_entries(dstr_t *out, const char *dict, const char *end, const char *skip)
+{
+    const char *p = skip_space(dict, end) + 2, *key, *val, *next;
+    size_t keylen, skiplen = strlen(skip);
+
+    while ((next = dict_next(p, end, &key, &keylen, &val))) {
+        if (keylen != skiplen || memcmp(key, skip, keylen)) {
+            dstrncat(out, " /", 2);
+            dstrncat(out, key, keylen);
+            dstrncat(out, " ", 1);
+            dstrncat(out, val, next - val);
+        }
+        p = next;
+    }
+}
+
+static void subset_add_page(pdf_file_t *pdf, subset_t *sub, int num,
+                            const char *page, const char *end, const inherited_t *inh)
+{
+    int gen = pdf->xref[num].type == XREF_OFFSET ? pdf->xref[num].index : 0;
+    int i;
+
+    subset_begin_object(sub, num, gen);
+    copy_dict_entries(sub->out, page, end, "Parent");
+    for (i = 0; i < INHERITABLE_COUNT; i++) {
+        if (inh->val[i] && !dict_get(page, end, inheritable[i])) {
+            dstrcatf(sub->out, " /%s ", inheritable[i]);
+            dstrncat(sub->out, inh->val[i], inh->len[i]);
+        }
+    }
+    dstrcatf(sub->out, " /Parent %d 0 R >>\nendobj\n", sub->newroot);
+
+    dstrcatf(sub->kids, "%d %d R ", num, gen);
+    sub->pagecount++;
+}
+
+static int walk_page_tree(pdf_file_t *pdf, subset_t *sub, int num, inherited_t inh, int depth)
+{
+    const char *node, *end, *p, *q, *kid, *kidend;
+    long long count;
+    int i, kidnum, kidgen;
+
+    if (depth > PDF_MAX_NESTING || ++sub->nodes > PDF_MAX_OBJECTS ||
+        !(node = pdf_object(pdf, num, &end)) || !is_dict(node, end))
+        return 0;
+
+    for (i = 0; i < INHERITABLE_COUNT; i++) {
+        if ((p = dict_get(node, end, inheritable[i])) && (q = skip_value(p, end))) {
+            inh.val[i] = p;
+            inh.len[i] = q - p;
+        }
+    }
+
+    if (!(p = dict_get(node, end, "Kids"))) {
+        /* A page */
+        sub->pageno++;
+        if (sub->pageno >= sub->first && sub->pageno <= sub->last)
+            subset_add_page(pdf, sub, num, node, end, &inh);
+        return 1;
+    }
+
+    if (*p != '[')
+        return 0;
+    for (p++; sub->pageno < sub->last; ) {
+        p = skip_space(p, end);
+        if (p < end && *p == ']')
+            break;
+        if (!(p = parse_objref(p, end, "R", &kidnum, &kidgen)))
+            return 0;
+
+        /* Skip subtrees which end before the first page */
+        if ((kid = pdf_object(pdf, kidnum, &kidend)) && is_dict(kid, kidend) &&
+            dict_get(kid, kidend, "Kids") &&
+            dict_get_int(pdf, kid, kidend, "Count", &count) &&
+            count >= 0 && sub->pageno + count < sub->first) {
+            sub->pageno += count;
+            continue;
+        }
+        if (!walk_page_tree(pdf, sub, kidnum, inh, depth +1))
+            return 0;
+    }
+    return 1;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    return ((const subset_entry_t *)a)->num - ((const subset_entry_t *)b)->num;
+}
+
+/* Append a field of 'width' bytes, most significant first */
+static void put_field(dstr_t *ds, unsigned long long val, int width)
+{
+    char c;
+
+    while (width--) {
+        c = (val >> (8 * width)) & 0xff;
+        dstrncat(ds, &c, 1);
+    }
+}
+
+/* The /Info and /ID entries of the original trailer, which the trailer of
+   the update has to repeat */
+static void subset_write_trailer_entries(pdf_file_t *pdf, subset_t *sub)
+{
+    if (pdf->info) {
+        dstrcat(sub->out, " /Info ");
+        dstrncat(sub->out, pdf->info, pdf->infolen);
+    }
+    if (pdf->id) {
+        dstrcat(sub->out, " /ID ");
+        dstrncat(sub->out, pdf->id, pdf->idlen);
+    }
+}
+
+/* Cross-reference section and trailer of the update, of the same kind as
+   the newest section of the file */
+static void subset_write_xref(pdf_file_t *pdf, subset_t *sub)
+{
+    size_t xrefoffset = sub->base + sub->out->len;
+    dstr_t *index, *rows;
+    int i, j, w;
+
+    if (pdf->xrefstream)
+        subset_begin_object(sub, sub->newroot +1, 0);
+    qsort(sub->entries, sub->count, sizeof(subset_entry_t), compare_entries);
+
+    if (!pdf->xrefstream) {
+        dstrcat(sub->out, "xref\n");
+        for (i = 0; i < sub->count; i = j) {
+            for (j = i +1; j < sub->count && sub->entries[j].num == sub->entries[j -1].num +1; j++)
+                ;
+            dstrcatf(sub->out, "%d %d\n", sub->entries[i].num, j - i);
+            for (; i < j; i++)
+                dstrcatf(sub->out, "%010lu %05d n\r\n",
+                         (unsigned long)sub->entries[i].offset, sub->entries[i].gen);
+        }
+        dstrcatf(sub->out, "trailer\n<< /Size %d /Root %d %d R /Prev %lld",
+                 sub->newroot +1, pdf->rootnum, pdf->rootgen, pdf->startxref);
+        subset_write_trailer_entries(pdf, sub);
+        dstrcat(sub->out, " >>\n");
+    }
+    else {
+        for (w = 1; w < 8 && (xrefoffset >> (8 * w)); w++)
+            ;
+        index = create_dstr();
+        rows = create_dstr();
+        for (i = 0; i < sub->count; i = j) {
+            for (j = i +1; j < sub->count && sub->entries[j].num == sub->entries[j -1].num +1; j++)
+                ;
+            dstrcatf(index, "%d %d ", sub->entries[i].num, j - i);
+            for (; i < j; i++) {
+                put_field(rows, 1, 1);
+                put_field(rows, sub->entries[i].offset, w);
+                put_field(rows, sub->entries[i].gen, 2);
+            }
+        }
+        /* subset_begin_object() has written "<<" already */
+        dstrcatf(sub->out, " /Type /XRef /Size %d /W [1 %d 2] /Index [%s] "
+                 "/Root %d %d R /Prev %lld /Length %lu",
+                 sub->newroot +2, w, index->data, pdf->rootnum, pdf->rootgen,
+                 pdf->startxref, (unsigned long)rows->len);
+        subset_write_trailer_entries(pdf, sub);
+        dstrcat(sub->out, " >>\nstream\n");
+        dstrncat(sub->out, rows->data, rows->len);
+        dstrcat(sub->out, "\nendstream\nendobj\n");
+        free_dstr(index);
+        free_dstr(rows);
+    }
+    dstrcatf(sub->out, "startxref\n%lu\n%%%%EOF\n", (unsigned long)xrefoffset);
+}
+
+dstr_t * pdf_page_subset(pdf_file_t *pdf, int first, int last)
+{
+    const char *catalog, *end;
+    int pagesnum, pagesgen;
+    inherited_t inh;
+    subset_t sub;
+
+    if (!(catalog = pdf_object(pdf, pdf->rootnum, &end)) || !is_dict(catalog, end) ||
+        !parse_objref(dict_get(catalog, end, "Pages") ?: end, end, "R", &pagesnum, &pagesgen))
+        return NULL;
+
+    memset(&sub, 0, sizeof(subset_t));
+    memset(&inh, 0, sizeof(inherited_t));
+    sub.first = first;
+    sub.last = last > 0 ? last : INT_MAX;
+    sub.newroot = pdf->xrefsize;
+    sub.base = pdf->len;
+    sub.out = create_dstr();
+    sub.kids = create_dstr();
+    if (pdf->data[pdf->len -1] != '\n' && pdf->data[pdf->len -1] != '\r') {
+        dstrcat(sub.out, "\n");
+    }
+
+    if (!walk_page_tree(pdf, &sub, pagesnum, inh, 0) || !sub.pagecount) {
+        _log("Could not read the page tree of the PDF file\n");
+        free_dstr(sub.out);
+        free_dstr(sub.kids);
+        free(sub.entries);
+        return NULL;
+    }
+
+    /* The new page tree */
+    subset_begin_object(&sub, sub.newroot, 0);
+    dstrcatf(sub.out, " /Type /Pages /Count %d /Kids [ %s] >>\nendobj\n",
+             sub.pagecount, sub.kids->data);
+
+    /* New version of the catalog */
+    subset_begin_object(&sub, pdf->rootnum, pdf->rootgen);
+    copy_dict_entries(sub.out, catalog, end, "Pages");
+    dstrcatf(sub.out, " /Pages %d 0 R >>\nendobj\n", sub.newroot);
+
+    subset_write_xref(pdf, &sub);
+
+    free_dstr(sub.kids);
+    free(sub.entries);
+    return sub.out;
+}
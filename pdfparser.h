@@ -0,0 +1,72 @@
+/* pdfparser.h
+ *
+ * This file is part of foomatic-rip.
+ *
+ * Foomatic-rip is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Foomatic-rip is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef pdfparser_h
+#define pdfparser_h
+
+#include <stddef.h>
+#include "util.h"
+
+/* Minimal reader for the structure of PDF files: cross-reference tables and
+   streams, object streams and the page tree. It does not interpret page
+   contents. All functions fail (return NULL or -1) on damaged, encrypted
+   or otherwise unsupported files, the caller then falls back to asking
+   Ghostscript. */
+
+typedef struct pdf_xref_entry pdf_xref_entry_t;
+typedef struct pdf_objstm pdf_objstm_t;
+
+typedef struct pdf_file {
+    int fd;
+    const char *data;       /* the memory-mapped file */
+    size_t len;
+
+    pdf_xref_entry_t *xref; /* indexed by object number */
+    int xrefsize;
+
+    int rootnum;            /* the document catalog */
+    int rootgen;
+
+    long long startxref;    /* newest cross-reference section */
+    int xrefstream;         /* it is a cross-reference stream */
+
+    const char *info;       /* values of /Info and /ID in the newest */
+    size_t infolen;         /* trailer which has them, NULL if none */
+    const char *id;
+    size_t idlen;
+
+    pdf_objstm_t *objstms;  /* decompressed object streams */
+} pdf_file_t;
+
+pdf_file_t * pdf_open(const char *filename);
+void pdf_close(pdf_file_t *pdf);
+
+/* Number of pages, from the "/Count" of the root of the page tree */
+int pdf_page_count(pdf_file_t *pdf);
+
+/* Incremental update to append to the file, so that it becomes a document
+   with only the pages 'first' through 'last': a new page tree with these
+   pages and a new version of the catalog pointing to it. The page objects
+   get written again with the attributes they inherited from the old tree.
+   Returns NULL if the page tree cannot be read. */
+dstr_t * pdf_page_subset(pdf_file_t *pdf, int first, int last);
+
+#endif
+
@@ -27,31 +27,155 @@
 #include "fileconverter.h"
 #include "renderer.h"
 #include "process.h"
+#include "pump.h"
 
 #include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-void get_renderer_handle(const dstr_t *prepend, FILE **fd, pid_t *pid);
+void get_renderer_handle(fbuf_t *header, const fbuf_t *fifo, FILE **fd, pid_t *pid, pid_t *gated);
+static pid_t start_renderer(int optset, FILE **fd, int gated, int gsonly);
 int close_renderer_handle(FILE *rendererhandle, pid_t rendererpid);
 
-#define LT_BEGIN_FEATURE 1
-#define LT_FOOMATIC_RIP_OPTION_SETTING 2
-int line_type(const char *line)
+/* Returns 1 if the data between p and end starts with 'prefix' */
+static int memstartswith(const char *p, const char *end, const char *prefix)
 {
-    const char *p;
-    if (startswith(line, "%%BeginFeature:"))
-        return LT_BEGIN_FEATURE;
-    p = line;
-    while (*p && isspace(*p)) p++;
-    if (!startswith(p, "%%"))
-        return 0;
+    size_t len = strlen(prefix);
+    return (size_t)(end - p) >= len && !memcmp(p, prefix, len);
+}
+
+/* The DSC comments which _print_ps() is interested in. The Begin... values
+   must stay together, see DSC_IS_BEGIN() */
+enum dsc_keyword {
+    DSC_NONE = 0,
+    DSC_BEGIN_OTHER,                /* any other "%%Begin..." */
+    DSC_BEGIN_BINARY,               /* "%%BeginBinary:" */
+    DSC_BEGIN_DATA,                 /* "%%BeginData:" */
+    DSC_BEGIN_DOCUMENT,             /* "%%BeginDocument" */
+    DSC_BEGIN_FEATURE,              /* "%%BeginFeature:" */
+    DSC_BEGIN_PAGE_SETUP,           /* "%%BeginPageSetup" */
+    DSC_BEGIN_PROLOG,               /* "%%BeginProlog" */
+    DSC_BEGIN_SETUP,                /* "%%BeginSetup" */
+    DSC_END_DOCUMENT,               /* "%%EndDocument" */
+    DSC_END_FEATURE,                /* "%%EndFeature" */
+    DSC_END_PAGE_SETUP,             /* "%%EndPageSetup" */
+    DSC_END_PROLOG,                 /* "%%EndProlog" */
+    DSC_END_SETUP,                  /* "%%EndSetup" */
+    DSC_CREATOR,                    /* "%%Creator" */
+    DSC_PAGE,                       /* "%%Page:" */
+    DSC_PAGES,                      /* "%%Pages:" */
+    DSC_TRAILER,                    /* "%%Trailer" */
+    DSC_RBI_NUM_COPIES,             /* "%%RBINumCopies:" or "%RBINumCopies:" */
+    DSC_FOOMATIC_RIP_OPTION_SETTING /* "%% FoomaticRIPOptionSetting:" */
+};
+
+#define DSC_IS_BEGIN(kw) ((kw) >= DSC_BEGIN_OTHER && (kw) <= DSC_BEGIN_SETUP)
+
+/* Classify the comment line of 'len' bytes at 'line' (which does not need
+   to be zero-terminated) by its keyword. This is a trie over the keywords
+   above: every byte of the keyword is looked at only once, the unique rest
+   of a keyword is compared in one go. */
+static enum dsc_keyword dsc_keyword(const char *line, size_t len)
+{
+    const char *p = line, *end = line + len;
+
+    if (len < 2 || p[0] != '%')
+        return DSC_NONE;
+    if (p[1] != '%')
+        return memstartswith(&p[1], end, "RBINumCopies:") ? DSC_RBI_NUM_COPIES : DSC_NONE;
     p += 2;
-    while (*p && isspace(*p)) p++;
-    if (startswith(p, "FoomaticRIPOptionSetting:"))
-        return LT_FOOMATIC_RIP_OPTION_SETTING;
-    return 0;
+    if (p == end)
+        return DSC_NONE;
+
+    switch (*p++) {
+    case 'B':
+        if (!memstartswith(p, end, "egin"))
+            return DSC_NONE;
+        p += 4;
+        if (p == end)
+            return DSC_BEGIN_OTHER;
+        switch (*p++) {
+        case 'B':
+            if (memstartswith(p, end, "inary:"))
+                return DSC_BEGIN_BINARY;
+            break;
+        case 'D':
+            if (p == end)
+                break;
+            if (*p == 'a' && memstartswith(&p[1], end, "ta:"))
+                return DSC_BEGIN_DATA;
+            if (*p == 'o' && memstartswith(&p[1], end, "cument"))
+                return DSC_BEGIN_DOCUMENT;
+            break;
+        case 'F':
+            if (memstartswith(p, end, "eature:"))
+                return DSC_BEGIN_FEATURE;
+            break;
+        case 'P':
+            if (p == end)
+                break;
+            if (*p == 'a' && memstartswith(&p[1], end, "geSetup"))
+                return DSC_BEGIN_PAGE_SETUP;
+            if (*p == 'r' && memstartswith(&p[1], end, "olog"))
+                return DSC_BEGIN_PROLOG;
+            break;
+        case 'S':
+            if (memstartswith(p, end, "etup"))
+                return DSC_BEGIN_SETUP;
+            break;
+        }
+        return DSC_BEGIN_OTHER;
+
+    case 'C':
+        return memstartswith(p, end, "reator") ? DSC_CREATOR : DSC_NONE;
+
+    case 'E':
+        if (!memstartswith(p, end, "nd") || (p += 2) == end)
+            return DSC_NONE;
+        switch (*p++) {
+        case 'D':
+            return memstartswith(p, end, "ocument") ? DSC_END_DOCUMENT : DSC_NONE;
+        case 'F':
+            return memstartswith(p, end, "eature") ? DSC_END_FEATURE : DSC_NONE;
+        case 'P':
+            if (p == end)
+                return DSC_NONE;
+            if (*p == 'a' && memstartswith(&p[1], end, "geSetup"))
+                return DSC_END_PAGE_SETUP;
+            if (*p == 'r' && memstartswith(&p[1], end, "olog"))
+                return DSC_END_PROLOG;
+            return DSC_NONE;
+        case 'S':
+            return memstartswith(p, end, "etup") ? DSC_END_SETUP : DSC_NONE;
+        }
+        return DSC_NONE;
+
+    case 'P':
+        if (memstartswith(p, end, "age:"))
+            return DSC_PAGE;
+        return memstartswith(p, end, "ages:") ? DSC_PAGES : DSC_NONE;
+
+    case 'R':
+        return memstartswith(p, end, "BINumCopies:") ? DSC_RBI_NUM_COPIES : DSC_NONE;
+
+    case 'T':
+        return memstartswith(p, end, "railer") ? DSC_TRAILER : DSC_NONE;
+
+    case ' ': case '\t': case '\r': case '\v': case '\f':
+        while (p < end && isspace(*p))
+            p++;
+        return memstartswith(p, end, "FoomaticRIPOptionSetting:") ?
+            DSC_FOOMATIC_RIP_OPTION_SETTING : DSC_NONE;
+
+    case 'F':
+        return memstartswith(p, end, "oomaticRIPOptionSetting:") ?
+            DSC_FOOMATIC_RIP_OPTION_SETTING : DSC_NONE;
+    }
+    return DSC_NONE;
 }
 
 
@@ -152,53 +276,790 @@ int line_type(const char *line)
 #define MAX_NON_DSC_LINES_IN_HEADER 1000
 #define MAX_LINES_FOR_PAGE_OPTIONS 200
 
+#define STREAM_BUFSIZE 65536
+
+/* Byte offsets of the DSC structure of a memory-mapped job, relative to the
+   beginning of the job data */
+typedef struct {
+    size_t headerend;       /* first "%%Page:", or trailer if there is none */
+    size_t trailer;         /* "%%Trailer" or, without it, "%%EOF", end of
+                               data if there is neither */
+    size_t *pages;          /* the "%%Page:" comments */
+    int *pageoptions;       /* number of option settings found on each page */
+    int headeroptions;      /* option settings (and "%RBINumCopies") found
+                               before the first page */
+    int prolog, setup;      /* "%%BeginProlog", "%%BeginSetup" found before
+                               the first page */
+    int pagesetups;         /* pages with a "%%BeginPageSetup" */
+    int pagecount;
+    int pagealloc;
+} dsc_index_t;
+
+/* A part of the job data, as byte offsets like in dsc_index_t */
+typedef struct {
+    size_t start;
+    size_t end;
+} stream_range_t;
+
 typedef struct {
     size_t pos;
 
-    FILE *file;
+    FILE *file;             /* NULL if all data is in alreadyread */
     const char *alreadyread;
     size_t len;
+
+    char buf[STREAM_BUFSIZE]; /* alreadyread points here once the data
+                                 handed over by the caller is used up */
+
+    int midline;            /* last line was cut at ps_line_limit bytes */
+    int continued;          /* the current line is the rest of a cut line */
+
+    /* Random access mode: the input file is memory-mapped and alreadyread
+       points to the beginning of the job data in the mapping */
+    char *map;
+    size_t maplen;
+    size_t mapstart;
+    int mapfd;
+    dsc_index_t index;
+    stream_range_t *ranges; /* the parts of the job data in the order in
+                               which they are read, NULL to read it in the
+                               order of the file */
+    int rangecount;
+    int range;              /* the part which is read, it ends at len */
 } stream_t;
 
 void _print_ps(stream_t *stream);
 
+/* Make sure that there is unread data in s->alreadyread, returns the number
+   of bytes available there, 0 on EOF */
+static size_t stream_fill(stream_t *s)
+{
+    ssize_t n;
+
+    while (s->ranges && s->pos >= s->len && s->range +1 < s->rangecount) {
+        s->range++;
+        s->pos = s->ranges[s->range].start;
+        s->len = s->ranges[s->range].end;
+    }
+    if (s->pos < s->len)
+        return s->len - s->pos;
+    if (!s->file)
+        return 0;
+
+    /* Read from the descriptor, so that no data stays in the buffer of
+       s->file and the rest of the input can be handed on with
+       stream_forward_rest() */
+    s->alreadyread = s->buf;
+    s->pos = 0;
+    n = read_some(fileno(s->file), s->buf, STREAM_BUFSIZE);
+    s->len = n > 0 ? n : 0;
+    return s->len;
+}
+
+/* Reads the next line, but not more than ps_line_limit bytes of it. The rest
+   of a longer line is returned by the following calls, with s->continued
+   set. */
 int stream_next_line(dstr_t *line, stream_t *s)
 {
-    int c;
-    size_t cnt = 0;
+    const char *p, *nl = NULL;
+    size_t n, cnt = 0;
+
+    s->continued = s->midline;
+    s->midline = 0;
 
     dstrclear(line);
-    while (s->pos < s->len) {
-        c = s->alreadyread[s->pos++];
-        dstrputc(line, c);
-        cnt++;
-        if (c == '\n')
-            return cnt;
+    while (!nl && (n = stream_fill(s))) {
+        p = &s->alreadyread[s->pos];
+        if ((nl = memchr(p, '\n', n)))
+            n = nl - p + 1;
+        if (cnt + n > ps_line_limit) {
+            n = ps_line_limit - cnt;
+            nl = NULL;
+            s->midline = 1;
+        }
+        dstrncat(line, p, n);
+        s->pos += n;
+        cnt += n;
+        if (s->midline)
+            break;
     }
+    return cnt;
+}
 
-    while ((c = fgetc(s->file)) != EOF) {
-        dstrputc(line, c);
-        cnt++;
-        if (c == '\n')
-            return cnt;
+/* Data which is forwarded without parsing goes to 'dest' or, if it is NULL,
+   to 'out'. If both are NULL the data is dropped. */
+static void forward_data(const char *data, size_t len, fbuf_t *dest, FILE *out)
+{
+    if (dest)
+        fbufwrite(dest, data, len);
+    else if (out)
+        fwrite(data, len, 1, out);
+}
+
+/* Forward 'count' bytes (or lines, if 'lines' is set) of the stream as raw
+   blocks, without splitting them into lines */
+static void stream_forward(stream_t *s, size_t count, int lines, fbuf_t *dest, FILE *out)
+{
+    const char *p, *nl;
+    size_t n;
+
+    while (count && (n = stream_fill(s))) {
+        p = &s->alreadyread[s->pos];
+        if (lines) {
+            if ((nl = memchr(p, '\n', n))) {
+                n = nl - p + 1;
+                count--;
+            }
+        }
+        else {
+            if (n > count)
+                n = count;
+            count -= n;
+        }
+        forward_data(p, n, dest, out);
+        s->pos += n;
+    }
+}
+
+/* If 'line' is a "%%BeginBinary:" or "%%BeginData:" comment (keyword 'kw'),
+   returns the amount of data following it which must not be parsed, counted
+   in lines if '*lines' is set, in bytes otherwise. Returns 0 for all other
+   lines. */
+static size_t raw_data_size(const char *line, enum dsc_keyword kw, int *lines)
+{
+    const char *p;
+    char *end;
+    size_t cnt;
+
+    *lines = 0;
+    if (kw == DSC_BEGIN_BINARY)
+        p = &line[14];
+    else if (kw == DSC_BEGIN_DATA)
+        p = &line[12];
+    else
+        return 0;
+
+    cnt = strtoul(p, &end, 10);
+    if (end == p)
+        return 0;
+
+    if (kw == DSC_BEGIN_DATA) {
+        /* %%BeginData: <numberof> [<type> [<bytesorlines>]] */
+        p = skip_whitespace(end);
+        while (*p && !isspace(*p))
+            p++;
+        p = skip_whitespace(p);
+        if (startswith(p, "Lines"))
+            *lines = 1;
     }
     return cnt;
 }
 
+/* Fast forward mode for embedded documents: everything up to and including
+   the "%%EndDocument" matching an already read "%%BeginDocument" is
+   forwarded in blocks. Only comment lines are looked at, to keep track of
+   the nesting and of binary data which could contain "%%EndDocument". */
+static void stream_forward_document(stream_t *s, fbuf_t *dest, FILE *out)
+{
+    dstr_t *line = create_dstr();
+    int nestinglevel = 1;
+    int atlinestart = 1;
+    int lines;
+    enum dsc_keyword kw;
+    size_t n, cnt;
+    const char *p, *q;
+
+    while (nestinglevel > 0 && (n = stream_fill(s))) {
+        p = &s->alreadyread[s->pos];
+
+        if (atlinestart && *p == '%') {
+            stream_next_line(line, s);
+            forward_data(line->data, line->len, dest, out);
+            atlinestart = !s->midline;
+            kw = dsc_keyword(line->data, line->len);
+            if (kw == DSC_BEGIN_DOCUMENT)
+                nestinglevel++;
+            else if (kw == DSC_END_DOCUMENT)
+                nestinglevel--;
+            else if ((cnt = raw_data_size(line->data, kw, &lines)))
+                stream_forward(s, cnt, lines, dest, out);
+            continue;
+        }
+
+        /* Forward everything up to the next comment line in one block */
+        if ((q = memmem(p, n, "\n%", 2))) {
+            n = q - p + 1;
+            atlinestart = 1;
+        }
+        else
+            atlinestart = p[n -1] == '\n';
+        forward_data(p, n, dest, out);
+        s->pos += n;
+    }
+
+    free_dstr(line);
+}
+
+static void index_add_page(dsc_index_t *idx, size_t offset)
+{
+    if (idx->pagecount == idx->pagealloc) {
+        idx->pagealloc = idx->pagealloc ? idx->pagealloc * 2 : 64;
+        idx->pages = realloc(idx->pages, idx->pagealloc * sizeof(size_t));
+        idx->pageoptions = realloc(idx->pageoptions, idx->pagealloc * sizeof(int));
+    }
+    idx->pages[idx->pagecount] = offset;
+    idx->pageoptions[idx->pagecount] = 0;
+    idx->pagecount++;
+}
+
+/* Build the DSC index of the 'len' bytes of job data in one pass. Only
+   lines starting with "%" are looked at, binary data and embedded
+   documents are skipped like in stream_forward_document() */
+static void build_dsc_index(dsc_index_t *idx, const char *data, size_t len)
+{
+    const char *p = data, *end = data + len, *eol;
+    char comment[256];
+    enum dsc_keyword kw;
+    int nestinglevel = 0, lines, setuppage = 0;
+    size_t cnt;
+
+    memset(idx, 0, sizeof(dsc_index_t));
+    idx->headerend = idx->trailer = len;
+
+    while (p < end) {
+        if (*p != '%') {
+            /* Active PostScript code, go to the next comment line */
+            if (!(eol = memmem(p, end - p, "\n%", 2)))
+                break;
+            p = eol + 1;
+            continue;
+        }
+
+        eol = memchr(p, '\n', end - p);
+        eol = eol ? eol + 1 : end;
+        kw = dsc_keyword(p, eol - p);
+
+        if (kw == DSC_BEGIN_DOCUMENT)
+            nestinglevel++;
+        else if (kw == DSC_END_DOCUMENT) {
+            if (nestinglevel > 0)
+                nestinglevel--;
+        }
+        else if (kw == DSC_BEGIN_BINARY || kw == DSC_BEGIN_DATA) {
+            cnt = (size_t)(eol - p) < sizeof(comment) ? (size_t)(eol - p) : sizeof(comment) -1;
+            memcpy(comment, p, cnt);
+            comment[cnt] = '\0';
+            if ((cnt = raw_data_size(comment, kw, &lines))) {
+                if (lines) {
+                    while (cnt-- && eol < end) {
+                        eol = memchr(eol, '\n', end - eol);
+                        eol = eol ? eol + 1 : end;
+                    }
+                }
+                else
+                    eol = (size_t)(end - eol) > cnt ? eol + cnt : end;
+            }
+        }
+        else if (nestinglevel == 0) {
+            if (kw == DSC_PAGE) {
+                if (idx->pagecount == 0)
+                    idx->headerend = p - data;
+                index_add_page(idx, p - data);
+                /* Only a trailer after the last page counts */
+                idx->trailer = len;
+            }
+            else if (kw == DSC_TRAILER)
+                idx->trailer = p - data;
+            else if (idx->trailer == len && memstartswith(p, eol, "%%EOF"))
+                idx->trailer = p - data;
+            else if (kw == DSC_BEGIN_FEATURE || kw == DSC_FOOMATIC_RIP_OPTION_SETTING ||
+                     memmem(p, eol - p, "FoomaticRIPOptionSetting", 24)) {
+                if (idx->pagecount > 0)
+                    idx->pageoptions[idx->pagecount -1]++;
+                else
+                    idx->headeroptions++;
+            }
+            else if (kw == DSC_RBI_NUM_COPIES && idx->pagecount == 0)
+                idx->headeroptions++;
+            else if (kw == DSC_BEGIN_PROLOG && idx->pagecount == 0)
+                idx->prolog = 1;
+            else if (kw == DSC_BEGIN_SETUP && idx->pagecount == 0)
+                idx->setup = 1;
+            else if (kw == DSC_BEGIN_PAGE_SETUP && idx->pagecount > setuppage) {
+                setuppage = idx->pagecount;
+                idx->pagesetups++;
+            }
+        }
+        p = eol;
+    }
+
+    if (idx->pagecount == 0)
+        idx->headerend = idx->trailer;
+}
+
+static void free_dsc_index(dsc_index_t *idx)
+{
+    free(idx->pages);
+    free(idx->pageoptions);
+    memset(idx, 0, sizeof(dsc_index_t));
+}
+
+/* Switch to random access mode if 'file' is a regular file. 'alreadyread'
+   must be the data which has been read from the current position of
+   'file'. Returns 0 if the file cannot be mapped. */
+static int stream_map(stream_t *s, FILE *file, const char *alreadyread, size_t len)
+{
+    struct stat st;
+    off_t start;
+    char *map;
+
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return 0;
+
+    start = ftello(file);
+    if (start < (off_t)len || start > st.st_size)
+        return 0;
+    start -= len;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (map == MAP_FAILED)
+        return 0;
+
+    if (len && memcmp(&map[start], alreadyread, len) != 0) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    s->map = map;
+    s->maplen = st.st_size;
+    s->mapstart = start;
+    s->mapfd = fileno(file);
+
+    s->file = NULL;
+    s->alreadyread = &map[start];
+    s->len = st.st_size - start;
+    s->pos = 0;
+
+    build_dsc_index(&s->index, s->alreadyread, s->len);
+    _log("Mapped %lu bytes of input, %d pages, header %lu bytes, trailer at %lu\n",
+         (unsigned long)s->len, s->index.pagecount,
+         (unsigned long)s->index.headerend, (unsigned long)s->index.trailer);
+    return 1;
+}
+
+/* Read the pages of a memory-mapped job in reverse order: the header, the
+   pages from the last to the first, then the trailer. Option settings on a
+   page can also apply to the following ones, so jobs with such pages keep
+   their order. */
+static void stream_reverse_pages(stream_t *s)
+{
+    dsc_index_t *idx = &s->index;
+    int i, n = 0;
+
+    if (idx->pagecount < 2)
+        return;
+    for (i = 0; i < idx->pagecount; i++) {
+        if (idx->pageoptions[i]) {
+            _log("Page %d contains option settings, not reversing the page order\n", i +1);
+            return;
+        }
+    }
+    if (idx->trailer == s->len && s->alreadyread[s->len -1] != '\n') {
+        _log("Last page does not end with a line break, not reversing the page order\n");
+        return;
+    }
+
+    s->ranges = malloc((idx->pagecount +2) * sizeof(stream_range_t));
+    s->ranges[n].start = 0;
+    s->ranges[n++].end = idx->headerend;
+    for (i = idx->pagecount -1; i >= 0; i--) {
+        s->ranges[n].start = idx->pages[i];
+        s->ranges[n++].end = i +1 < idx->pagecount ? idx->pages[i +1] : idx->trailer;
+    }
+    s->ranges[n].start = idx->trailer;
+    s->ranges[n++].end = s->len;
+
+    s->rangecount = n;
+    s->range = 0;
+    s->len = s->ranges[0].end;
+    _log("Printing the %d pages in reverse order\n", idx->pagecount);
+}
+
+static void stream_free_ranges(stream_t *s)
+{
+    free(s->ranges);
+    s->ranges = NULL;
+    s->rangecount = s->range = 0;
+}
+
+/* Leave random access mode, the rest of the data can be read from stdin
+   afterwards (needed when the file converter takes over). This happens
+   while the header is read, which comes first in any page order. */
+static void stream_unmap(stream_t *s)
+{
+    if (!s->map)
+        return;
+
+    if (s->mapfd != fileno(stdin) && dup2(s->mapfd, fileno(stdin)) < 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not dup input file to stdin\n");
+    if (fseeko(stdin, s->mapstart + s->pos, SEEK_SET) != 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not seek in input file\n");
+
+    munmap(s->map, s->maplen);
+    s->map = NULL;
+    free_dsc_index(&s->index);
+    stream_free_ranges(s);
+
+    s->file = stdin;
+    s->alreadyread = s->buf;
+    s->pos = s->len = 0;
+}
+
+/* In random access mode, send everything up to the next DSC comment line
+   directly out of the mapping to 'out'. Must be called at the beginning
+   of a line. */
+static void stream_forward_to_comment(stream_t *s, FILE *out)
+{
+    const char *p, *q;
+    size_t n;
+
+    if (!s->map || s->pos >= s->len)
+        return;
+
+    p = &s->alreadyread[s->pos];
+    n = s->len - s->pos;
+    if (memstartswith(p, p + n, "%%"))
+        return;
+    if ((q = memmem(p, n, "\n%%", 3)))
+        n = q - p + 1;
+    fwrite(p, n, 1, out);
+    s->pos += n;
+}
+
+/* In random access mode, the index of the page whose "%%Page:" comment is
+   the line of 'linelen' bytes just read, -1 if it is not such a comment */
+static int stream_page_index(stream_t *s, size_t linelen)
+{
+    dsc_index_t *idx = &s->index;
+    size_t offset;
+    int lo = 0, hi = idx->pagecount -1, mid;
+
+    if (!s->map || s->midline || s->pos < linelen)
+        return -1;
+
+    offset = s->pos - linelen;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (idx->pages[mid] == offset)
+            return mid;
+        if (idx->pages[mid] < offset)
+            lo = mid +1;
+        else
+            hi = mid -1;
+    }
+    return -1;
+}
+
+/* Number of the page in the job which starts with the "%%Page:" comment of
+   'linelen' bytes just read, when it is the 'ordinal'th page read. Both
+   differ only when the pages are read in reverse order. */
+static int stream_page_number(stream_t *s, size_t linelen, int ordinal)
+{
+    int i;
+
+    if (!s->ranges || (i = stream_page_index(s, linelen)) < 0)
+        return ordinal;
+    return i +1;
+}
+
+/* In random access mode, continue reading after the page (at the next page
+   in the file or the trailer), when the line of 'linelen' bytes just read
+   is its "%%Page:" comment and it has no option settings */
+static void stream_skip_page(stream_t *s, size_t linelen)
+{
+    dsc_index_t *idx = &s->index;
+    int i = stream_page_index(s, linelen);
+
+    if (i < 0 || idx->pageoptions[i])
+        return;
+
+    s->pos = i +1 < idx->pagecount ? idx->pages[i +1] : idx->trailer;
+}
+
+/* With page selection, set the number in the "%%Pages:" comment 'line' to
+the number of pages which get printed: in the header those of the
+announced pages which are selected, in the trailer 'printed' */
+static void fix_pages_comment(dstr_t *line, int inheader, int printed)
+{
+    char *p = (char *)skip_whitespace(&line->data[8]), *end;
+    int pages, i;
+
+    pages = strtol(p, &end, 10);
+    if (end == p)
+        return;     /* "(atend)" */
+
+    if (inheader) {
+        printed = 0;
+        for (i = 1; i <= pages; i++)
+            if (page_selected(i))
+                printed++;
+    }
+    _log("Changing the number of pages from %d to %d\n", pages, printed);
+    dstrremove(line, p - line->data, end - p);
+    dstrinsertf(line, p - line->data, "%d", printed);
+}
+
+/* Send the contents of a file buffer to the renderer */
+static void send_fbuf(const fbuf_t *fb, FILE *out)
+{
+    fflush(out);
+    if (!fbufsend(fb, pump_fileno(out)))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not send data to the renderer\n");
+}
+
+static void insert_fbuf(fbuf_t *fb, size_t offset, const char *str)
+{
+    if (!fbufinsert(fb, offset, str))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not insert option code into the PostScript header\n");
+}
+
+/* A renderer which is started as soon as a DSC-conforming job is recognized,
+   with the command line for the "header" option set, to overlap its startup
+   with reading the PostScript header. Its output is held back until the
+   first page starts; it is discarded
+   if the header changes the command line or JCL, or if the part of the
+   header which it has already got gets modified. */
+typedef struct {
+    pid_t pid;              /* 0 if there is no such renderer */
+    FILE *handle;
+    size_t sent;            /* bytes of the header which it has got */
+} early_renderer_t;
+
+static void early_renderer_start(early_renderer_t *er, int optset)
+{
+    er->pid = start_renderer(optset, &er->handle, 1, 1);
+    er->sent = 0;
+    if (er->pid)
+        optionset_copy_values(optset, optionset("earlyrenderer"));
+}
+
+/* Pass the data which has been added to 'header' since the last call */
+static void early_renderer_feed(early_renderer_t *er, const fbuf_t *header)
+{
+    fflush(er->handle);
+    if (!fbufsendfrom(header, er->sent, pump_fileno(er->handle)))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not send the PostScript header to the renderer\n");
+    er->sent = fbuflen(header);
+}
+
+/* Its exit status does not matter, it produces no output in any case */
+static void early_renderer_discard(early_renderer_t *er)
+{
+    _log("Discarding the early started renderer\n");
+    fclose(er->handle);
+    discard_renderer_output(er->pid);
+    er->pid = 0;
+}
+
+/* Use the early started renderer for the first page if the option set of
+   the page leads to the same command line and JCL, otherwise discard it.
+   Returns 1 if the renderer was taken over into 'fd' and 'pid', the rest
+   of 'header' and the 'fifo' are sent to it then. */
+static int early_renderer_adopt(early_renderer_t *er, const fbuf_t *header,
+                                const fbuf_t *fifo, FILE **fd, pid_t *pid)
+{
+    if (!er->pid)
+        return 0;
+    if (!optionset_equal_renderer(optionset("currentpage"), optionset("earlyrenderer"))) {
+        _log("Command line/JCL options changed in the header\n");
+        early_renderer_discard(er);
+        return 0;
+    }
+
+    _log("Using the early started renderer\n");
+    early_renderer_feed(er, header);
+    open_renderer_gate(er->pid);
+
+    *fd = er->handle;
+    *pid = er->pid;
+    er->pid = 0;
+
+    if (fifo)
+        send_fbuf(fifo, *fd);
+    return 1;
+}
+
+/* Renderer restarts are pipelined: the old renderer finishes in the
+   background while the new one starts up and gets its input already. The
+   output of the new one is held back until the old one has
+   exited, so the output of the renderers stays in order. At most one
+   renderer is finishing at any time. */
+typedef struct {
+    pid_t finishing;        /* previous renderer, its input is closed */
+    pid_t gated;            /* current renderer while its output is held
+                               back, 0 if there is none */
+} renderer_queue_t;
+
+/* If the finishing renderer has exited (with 'block' wait for it), check
+   its exit status and let the output of the current one through */
+static void renderer_queue_advance(renderer_queue_t *q, int block)
+{
+    int retval;
+
+    if (!q->finishing)
+        return;
+    if (block)
+        retval = close_renderer(q->finishing);
+    else if (!check_renderer(q->finishing, &retval))
+        return;
+    q->finishing = 0;
+
+    if (retval != EXIT_PRINTED)
+        rip_die(retval, "Error closing renderer\n");
+
+    if (q->gated) {
+        open_renderer_gate(q->gated);
+        q->gated = 0;
+    }
+}
+
+/* Close the input of the current renderer and let it finish in the
+   background, the next renderer which gets started waits for it */
+static void renderer_queue_retire(renderer_queue_t *q, FILE *rendererhandle, pid_t *rendererpid)
+{
+    renderer_queue_advance(q, 1);
+
+    _log("\nClosing renderer, the next one starts while it finishes\n");
+    fclose(rendererhandle);
+    q->finishing = *rendererpid;
+    *rendererpid = 0;
+}
+
+/* Send all the remaining input to 'out', the part which has not been read
+   yet is moved by the kernel with sendfile() or splice() */
+static void stream_forward_rest(stream_t *s, FILE *out)
+{
+    int ok;
+
+    if (s->pos < s->len && !s->map)
+        fwrite(&s->alreadyread[s->pos], s->len - s->pos, 1, out);
+    fflush(out);
+
+    if (s->map) {
+        ok = copy_fd_range(pump_fileno(out), s->mapfd, s->mapstart + s->pos, s->len - s->pos);
+        while (ok && s->ranges && ++s->range < s->rangecount)
+            ok = copy_fd_range(pump_fileno(out), s->mapfd, s->mapstart + s->ranges[s->range].start,
+                               s->ranges[s->range].end - s->ranges[s->range].start);
+    }
+    else
+        ok = copy_fd(pump_fileno(out), fileno(s->file));
+    if (!ok)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not send the input data to the renderer\n");
+    s->pos = s->len;
+}
+
+/* Called after the current line of _print_ps() is stored or sent, to pass
+   on the binary data or the embedded document which it introduces */
+static void forward_raw_data(stream_t *s, size_t *rawsize, int rawlines,
+                             int *nestinglevel, fbuf_t *dest, FILE *out)
+{
+    if (*rawsize) {
+        _log("Forwarding %lu %s of binary data\n", (unsigned long)*rawsize,
+             rawlines ? "lines" : "bytes");
+        stream_forward(s, *rawsize, rawlines, dest, out);
+        *rawsize = 0;
+    }
+    else if (*nestinglevel > 0) {
+        stream_forward_document(s, dest, out);
+        (*nestinglevel)--;
+        _log("End of embedded document, nesting level now: %d\n", *nestinglevel);
+    }
+}
+
+/* In random access mode, check whether _print_ps() would pass the job on
+   unchanged: it is DSC-conforming, neither the job nor the command line set
+   options for certain pages, no pages are to be selected or reordered and
+   there is no option code to insert. _print_ps() inserts the Prolog, Setup
+   and PageSetup sections which are missing, even if they stay empty, so
+   the job must have all of them. */
+static int stream_unmodified(stream_t *s)
+{
+    int i;
+
+    if (!s->map || s->ranges || !memstartswith(s->alreadyread, s->alreadyread + s->len, "%!PS-Adobe-"))
+        return 0;
+    /* Without parsing only the first line gets looked at */
+    if (dontparse)
+        return 1;
+
+    if (!s->index.prolog || !s->index.setup || s->index.pagesetups < s->index.pagecount)
+        return 0;
+    if (s->index.headeroptions || !isempty(pageranges) || page_specific_options())
+        return 0;
+    for (i = 0; i < s->index.pagecount; i++)
+        if (s->index.pageoptions[i])
+            return 0;
+
+    return !option_code_to_insert(optionset("header"));
+}
+
+/* Let the renderer read the job data of a memory-mapped job directly from
+   the input file, which gets its stdin */
+static void print_ps_unmodified(stream_t *s)
+{
+    pid_t rendererpid;
+    int retval;
+
+    _log("Job needs no changes, the renderer reads it directly from the input file\n");
+
+    if (s->mapfd != fileno(stdin) && dup2(s->mapfd, fileno(stdin)) < 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not dup input file to stdin\n");
+    if (lseek(fileno(stdin), s->mapstart, SEEK_SET) != (off_t)s->mapstart)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not seek in input file\n");
+
+    jobhasjcl = 0;
+    optionset_copy_values(optionset("header"), optionset("currentpage"));
+    rendererpid = start_renderer(optionset("currentpage"), NULL, 0, 0);
+
+    retval = close_renderer_handle(NULL, rendererpid);
+    if (retval != EXIT_PRINTED)
+        rip_die(retval, "Error closing renderer\n");
+}
+
 int print_ps(FILE *file, const char *alreadyread, size_t len, const char *filename)
 {
     stream_t stream;
 
-    if (file != stdin && (dup2(fileno(file), fileno(stdin)) < 0)) {
-        _log("Could not dup %s to stdin.\n", filename);
-        return 0;
+    stream.map = NULL;
+    stream.ranges = NULL;
+    stream.midline = stream.continued = 0;
+
+    /* Seekable input is memory-mapped and read in random access mode */
+    if (!stream_map(&stream, file, alreadyread, len)) {
+        if (file != stdin && (dup2(fileno(file), fileno(stdin)) < 0)) {
+            _log("Could not dup %s to stdin.\n", filename);
+            return 0;
+        }
+
+        stream.pos = 0;
+        stream.file = stdin;
+        stream.alreadyread = alreadyread;
+        stream.len = len;
     }
+    else if (reverseorder)
+        stream_reverse_pages(&stream);
+
+    if (stream_unmodified(&stream))
+        print_ps_unmodified(&stream);
+    else
+        _print_ps(&stream);
 
-    stream.pos = 0;
-    stream.file = stdin;
-    stream.alreadyread = alreadyread;
-    stream.len = len;
-    _print_ps(&stream);
+    if (stream.map) {
+        munmap(stream.map, stream.maplen);
+        free_dsc_index(&stream.index);
+        stream_free_ranges(&stream);
+    }
     return 1;
 }
 
@@ -245,12 +1106,13 @@ void _print_ps(stream_t *stream)
                                     non-PostScript options also in the
                                     "header" optionset. 0: otherwise. */
 
-    int insertoptions = 1;  /* If we find out that a file with a DSC magic
+    size_t insertoptions = 0; /* If we find out that a file with a DSC magic
                                string ("%!PS-Adobe-") is not really DSC-
                                conforming, we insert the options directly
                                after the line with the magic string. We use
-                               this variable to store the number of the line
-                               with the magic string */
+                               this variable to store the offset in @psheader
+                               right after the line with the magic string */
+    int insertafterline = 0; /* set insertoptions after storing this line */
 
     int prologfound = 0;    /* Did we find the
                                "%%BeginProlog...%%EndProlog" section? */
@@ -278,6 +1140,11 @@ void _print_ps(stream_t *stream)
                                and "%%EndDocument" (>0) We do not parse the
                                PostScript in an embedded document. */
 
+    size_t rawsize = 0;     /* Amount of binary data announced by
+                               "%%BeginBinary:" or "%%BeginData:" in the
+                               current line, it is forwarded unparsed */
+    int rawlines = 0;       /* 1: rawsize counts lines, 0: bytes */
+
     int inpageheader = 0;   /* Are we in the header of a page,
                                between "%%BeginPageSetup" and
                                "%%EndPageSetup" (1) or not (0). */
@@ -299,6 +1166,9 @@ void _print_ps(stream_t *stream)
                                  Will be set to 0 when a new "%%Page:"
                                  comment appears. */
 
+    int skippage = 0;       /* The current page is not among the selected
+                               pages ("page-ranges" option), it is dropped */
+
     int optset = optionset("header"); /* Where do the option settings which
                                          we have found go? */
 
@@ -308,12 +1178,15 @@ void _print_ps(stream_t *stream)
     dstr_t *onelinebefore = create_dstr();
     dstr_t *twolinesbefore = create_dstr();
 
-    /* The header of the PostScript file, to be send after each start of the renderer */
-    dstr_t *psheader = create_dstr();
+    /* The header of the PostScript file, to be send after each start of the
+       renderer. It is moved into a file when the renderer is started for the
+       first time, so that restarts do not need to copy it around. */
+    fbuf_t *psheader = create_fbuf();
 
     /* The input FIFO, data which we have pulled from stdin for examination,
        but not send to the renderer yet */
-    dstr_t *psfifo = create_dstr();
+    fbuf_t *psfifo = create_fbuf();
+    int psfifolines = 0;    /* number of input lines in psfifo */
 
     FILE *fileconverter_handle = NULL; /* File handle to converter process */
     pid_t fileconverter_pid = 0;  /* PID of the fileconverter process */
@@ -323,11 +1196,14 @@ void _print_ps(stream_t *stream)
     int ooo110 = 0;         /* Flag to work around an application bug */
 
     int currentpage = 0;   /* The page which we are currently printing */
+    int pagenumber = 0;    /* Its number in the job, differs from currentpage
+                              when the pages are read in reverse order */
+    int pagesprinted = 0;  /* Pages which are selected ("page-ranges") */
 
     option_t *o;
     const char *val;
 
-    int linetype;
+    enum dsc_keyword dsc = DSC_NONE; /* DSC keyword of the current line */
 
     dstr_t *linesafterlastbeginfeature = create_dstr(); /* All codelines after the last "%%BeginFeature" */
 
@@ -335,18 +1211,28 @@ void _print_ps(stream_t *stream)
     char value [128];
     int fromcomposite = 0;
 
-    dstr_t *pdest;
+    fbuf_t *pdest;
 
     double width, height;
 
     pid_t rendererpid = 0;
     FILE *rendererhandle = NULL;
 
+    early_renderer_t early;  /* Renderer started before the header is complete */
+    renderer_queue_t rqueue;  /* Renderer which is finishing after a restart */
+
     int retval;
 
     dstr_t *tmp = create_dstr();
     jobhasjcl = 0;
 
+    /* Keep the memory usage bounded, whatever the input looks like */
+    psheader->memlimit = ps_buffer_limit;
+    psfifo->memlimit = ps_buffer_limit;
+    early.pid = 0;
+    rqueue.finishing = 0;
+    rqueue.gated = 0;
+
     /* We do not parse the PostScript to find Foomatic options, we check
         only whether we have PostScript. */
     if (dontparse)
@@ -356,10 +1242,16 @@ void _print_ps(stream_t *stream)
 
     do {
         ignoreline = 0;
+        insertafterline = 0;
+        dsc = DSC_NONE;
 
         if (printprevpage || saved || stream_next_line(line, stream)) {
             saved = 0;
-            if (linect == nonpslines) {
+            if (stream->continued) {
+                /* Rest of a line which is longer than ps_line_limit, it is
+                   passed on without being parsed */
+            }
+            else if (linect == nonpslines) {
                 /* In the beginning should be the postscript leader,
                    sometimes after some JCL commands */
                 if ( !(line->data[0] == '%' && line->data[1] == '!') &&
@@ -386,10 +1278,15 @@ void _print_ps(stream_t *stream)
                         dstrclear(onelinebefore);
                         dstrclear(twolinesbefore);
 
-                        dstrcpyf(tmp, "%s%s%s", psheader, psfifo, line);
-                        dstrclear(psheader);
-                        dstrclear(psfifo);
+                        dstrclear(tmp);
+                        fbufread(psheader, tmp);
+                        fbufread(psfifo, tmp);
+                        dstrcat(tmp, line->data);
+                        fbufclear(psheader);
+                        fbufclear(psfifo);
+                        psfifolines = 0;
                         dstrclear(line);
+                        stream_unmap(stream);
 
                         /* Start the file conversion filter */
                         if (!fileconverter_pid)
@@ -413,11 +1310,18 @@ void _print_ps(stream_t *stream)
                         if (!dontparse) {
                             maxlines = 0;
                             isdscjob = 1;
-                            insertoptions = linect + 1;
+                            insertafterline = 1;
                             /* We have written into psfifo before, now we continue in
                                psheader and move over the data which is already in psfifo */
-                            dstrcat(psheader, psfifo->data);
-                            dstrclear(psfifo);
+                            dstrclear(tmp);
+                            fbufread(psfifo, tmp);
+                            fbufwrite(psheader, tmp->data, tmp->len);
+                            fbufclear(psfifo);
+                            psfifolines = 0;
+
+                            /* Let the renderer start up while we read the header */
+                            if (ps_early_renderer)
+                                early_renderer_start(&early, optset);
                         }
                         _log("--> This document is DSC-conforming!\n");
                     }
@@ -434,20 +1338,22 @@ void _print_ps(stream_t *stream)
                 }
             }
             else {
-                if (startswith(line->data, "%")) {
-                    if (startswith(line->data, "%%BeginDocument")) {
+                if (line->data[0] == '%') {
+                    dsc = dsc_keyword(line->data, line->len);
+                    rawsize = raw_data_size(line->data, dsc, &rawlines);
+                    if (dsc == DSC_BEGIN_DOCUMENT) {
                         /* Beginning of an embedded document
                         Note that Adobe Acrobat has a bug and so uses
                         "%%BeginDocument " instead of "%%BeginDocument:" */
                         nestinglevel++;
                         _log("Embedded document, nesting level now: %d\n", nestinglevel);
                     }
-                    else if (nestinglevel > 0 && startswith(line->data, "%%EndDocument")) {
+                    else if (nestinglevel > 0 && dsc == DSC_END_DOCUMENT) {
                         /* End of an embedded document */
                         nestinglevel--;
                         _log("End of embedded document, nesting level now: %d\n", nestinglevel);
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%Creator")) {
+                    else if (nestinglevel == 0 && dsc == DSC_CREATOR) {
                         /* Here we set flags to treat particular bugs of the
                         PostScript produced by certain applications */
                         p = strstr(line->data, "%%Creator") + 9;
@@ -465,7 +1371,7 @@ void _print_ps(stream_t *stream)
 			    ooo110 = 1;
                         }
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%BeginProlog")) {
+                    else if (nestinglevel == 0 && dsc == DSC_BEGIN_PROLOG) {
                         /* Note: Below is another place where a "Prolog" section
                         start will be considered. There we assume start of the
                         "Prolog" if the job is DSC-Conformimg, but an arbitrary
@@ -485,13 +1391,13 @@ void _print_ps(stream_t *stream)
                             prologfound = 1;
                         }
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%EndProlog")) {
+                    else if (nestinglevel == 0 && dsc == DSC_END_PROLOG) {
                         /* End of Prolog */
                         _log("Found: %%%%EndProlog\n");
                         inprolog = 0;
-                        insertoptions = linect +1;
+                        insertafterline = 1;
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%BeginSetup")) {
+                    else if (nestinglevel == 0 && dsc == DSC_BEGIN_SETUP) {
                         /* Beginning of Setup */
                         _log("\n-----------\nFound: %%%%BeginSetup\n");
                         insetup = 1;
@@ -535,7 +1441,7 @@ void _print_ps(stream_t *stream)
                             _log("\"%%%%BeginSetup\" in page header\n");
                         }
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%EndSetup")) {
+                    else if (nestinglevel == 0 && dsc == DSC_END_SETUP) {
                         /* End of Setup */
                         _log("Found: %%%%EndSetup\n");
                         insetup = 0;
@@ -555,7 +1461,7 @@ void _print_ps(stream_t *stream)
                                     setupfound = 1;
                                 }
                             }
-                            insertoptions = linect +1;
+                            insertafterline = 1;
                         }
                         else {
                             /* The "%%BeginSetup...%%EndSetup" which
@@ -565,7 +1471,7 @@ void _print_ps(stream_t *stream)
                             optionsalsointoheader = 0;
                         }
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%Page:")) {
+                    else if (nestinglevel == 0 && dsc == DSC_PAGE) {
                         if (!lastpassthru && !inheader) {
                             /* In the last line we were not in passthru mode,
                             so the last page is not printed. Prepare to do
@@ -580,6 +1486,7 @@ void _print_ps(stream_t *stream)
                             _log("\n-----------\nNew page: %s", line->data);
                             printprevpage = 0;
                             currentpage++;
+                            pagenumber = stream_page_number(stream, line->len, currentpage);
                             /* We consider the beginning of the page already as
                             page setup section, as some apps do not use
                             "%%PageSetup" tags. */
@@ -611,7 +1518,7 @@ void _print_ps(stream_t *stream)
                                     prologfound = 1;
                                 }
                                 /* Now we push this into the header */
-                                dstrcat(psheader, tmp->data);
+                                fbufwrite(psheader, tmp->data, tmp->len);
 
                                 /* The first page starts, so header ends */
                                 inheader = 0;
@@ -635,8 +1542,10 @@ void _print_ps(stream_t *stream)
                                     rint $rendererhandle
                                     "foomatic-saved-state restore\n"; */
 
-                                /* Save the option settings of the previous page */
-                                optionset_copy_values(optionset("currentpage"), optionset("previouspage"));
+                                /* Save the option settings of the previous page,
+                                   if it was printed */
+                                if (!skippage)
+                                    optionset_copy_values(optionset("currentpage"), optionset("previouspage"));
                                 optionset_delete_values(optionset("currentpage"));
                             }
                             /* Initialize the option set */
@@ -644,7 +1553,7 @@ void _print_ps(stream_t *stream)
 
                             /* Set the command line options which apply only
                                 to given pages */
-                            set_options_for_page(optionset("currentpage"), currentpage);
+                            set_options_for_page(optionset("currentpage"), pagenumber);
                             pagesetupfound = 0;
                             if (spooler == SPOOLER_CUPS) {
                                 /* Remove the "notfirst" flag from all options
@@ -663,10 +1572,27 @@ void _print_ps(stream_t *stream)
                             passthru = 0;
                             ignorepageheader = 0;
                             optionsalsointoheader = 0;
+
+                            /* Page selection: the code which was put into
+                               psfifo for a dropped page is not needed */
+                            if (skippage) {
+                                fbufclear(psfifo);
+                                psfifolines = 0;
+                            }
+                            skippage = !page_selected(pagenumber);
+                            if (!skippage)
+                                pagesprinted++;
+                            else {
+                                _log("Page %d is not selected, dropping it\n", pagenumber);
+                                /* With mapped input continue directly after
+                                   the page, if it does not contain option
+                                   settings */
+                                stream_skip_page(stream, line->len);
+                            }
                         }
                     }
                     else if (nestinglevel == 0 && !ignorepageheader &&
-                            startswith(line->data, "%%BeginPageSetup")) {
+                            dsc == DSC_BEGIN_PAGE_SETUP) {
                         /* Start of the page header, up to %%EndPageSetup
                         nothing of the page will be drawn, page-specific
                         option settngs (as letter-head paper for page 1)
@@ -684,7 +1610,7 @@ void _print_ps(stream_t *stream)
                         }
                     }
                     else if (nestinglevel == 0 && !ignorepageheader &&
-                            startswith(line->data, "%%BeginPageSetup")) {
+                            dsc == DSC_END_PAGE_SETUP) {
                         /* End of the page header, the page is ready to be printed */
                         _log("Found: %%%%EndPageSetup\n");
                         _log("End of page header\n");
@@ -702,11 +1628,10 @@ void _print_ps(stream_t *stream)
                         optionsalsointoheader = 0;
                     }
                     else if (nestinglevel == 0 && !optionreplaced && (!passthru || !isdscjob) &&
-                            ((linetype = line_type(line->data)) &&
-                            (linetype == LT_BEGIN_FEATURE || linetype == LT_FOOMATIC_RIP_OPTION_SETTING))) {
+                            (dsc == DSC_BEGIN_FEATURE || dsc == DSC_FOOMATIC_RIP_OPTION_SETTING)) {
 
                         /* parse */
-                        if (linetype == LT_BEGIN_FEATURE) {
+                        if (dsc == DSC_BEGIN_FEATURE) {
                             dstrcpy(tmp, line->data);
                             p = strtok(tmp->data, " \t"); /* %%BeginFeature: */
                             p = strtok(NULL, " \t="); /* Option */
@@ -716,7 +1641,7 @@ void _print_ps(stream_t *stream)
                             fromcomposite = 0;
                             strlcpy(value, p, 128);
                         }
-                        else { /* LT_FOOMATIC_RIP_OPTION_SETTING */
+                        else { /* DSC_FOOMATIC_RIP_OPTION_SETTING */
                             dstrcpy(tmp, line->data);
                             p = strstr(tmp->data, "FoomaticRIPOptionSetting:");
                             p = strtok(p, " \t");  /* FoomaticRIPOptionSetting */
@@ -733,7 +1658,7 @@ void _print_ps(stream_t *stream)
                         }
 
                         /* Mark that we are in a "Feature" section */
-                        if (linetype == LT_BEGIN_FEATURE) {
+                        if (dsc == DSC_BEGIN_FEATURE) {
                             infeature = 1;
                             dstrclear(linesafterlastbeginfeature);
                         }
@@ -748,7 +1673,7 @@ void _print_ps(stream_t *stream)
 			    (o->type != TYPE_NONE)) {
                             _log("   Option: %s=%s%s\n", optionname, fromcomposite ? "From" : "", value);
                             if (spooler == SPOOLER_CUPS &&
-                                linetype == LT_BEGIN_FEATURE &&
+                                dsc == DSC_BEGIN_FEATURE &&
                                 !option_get_value(o, optionset("notfirst")) &&
 				strcmp(option_get_value(o, optset) ?: "", value) != 0 &&
                                 (inheader || option_get_section(o) == SECTION_PAGESETUP)) {
@@ -794,12 +1719,12 @@ void _print_ps(stream_t *stream)
                                     if ((inheader && option_is_custom_value(o, val)) || !inheader)
                                     {
                                         if (o->type == TYPE_BOOL)
-                                            dstrcatf(pdest, "%%%%BeginFeature: *%s %s\n", o->name,
+                                            fbufprintf(pdest, "%%%%BeginFeature: *%s %s\n", o->name,
                                                      val && !strcmp(val, "1") ? "True" : "False");
                                         else
-                                            dstrcatf(pdest, "%%%%BeginFeature: *%s %s\n", o->name, val);
+                                            fbufprintf(pdest, "%%%%BeginFeature: *%s %s\n", o->name, val);
 
-                                        dstrcatf(pdest, "%s\n", tmp->data);
+                                        fbufprintf(pdest, "%s\n", tmp->data);
 
                                         /* We have replaced this option on the FIFO */
                                         optionreplaced = 1;
@@ -809,7 +1734,7 @@ void _print_ps(stream_t *stream)
                                     val = option_get_value(o, optset);
 
                                     if (!inheader || option_is_custom_value(o, val)) {
-                                        dstrcatf(pdest, "%%%% FoomaticRIPOptionSetting: %s=%s\n",
+                                        fbufprintf(pdest, "%%%% FoomaticRIPOptionSetting: %s=%s\n",
                                                  o->name, val ? val : "");
                                         optionreplaced = 1;
                                     }
@@ -843,7 +1768,7 @@ void _print_ps(stream_t *stream)
                                         if (o->type == TYPE_ENUM &&
                                                 (!strcmp(o->name, "PageSize") || !strcmp(o->name, "PageRegion")) &&
                                                 startswith(value, "Custom") &&
-                                                linetype == LT_FOOMATIC_RIP_OPTION_SETTING) {
+                                                dsc == DSC_FOOMATIC_RIP_OPTION_SETTING) {
                                             /* Custom Page size */
                                             width = height = 0.0;
                                             p = linesafterlastbeginfeature->data;
@@ -865,7 +1790,7 @@ void _print_ps(stream_t *stream)
                                         The code from the member options
                                         is chosen according to the setting
                                         of the composite option. */
-                                        if (option_is_composite(o) && linetype == LT_FOOMATIC_RIP_OPTION_SETTING) {
+                                        if (option_is_composite(o) && dsc == DSC_FOOMATIC_RIP_OPTION_SETTING) {
                                             build_commandline(optset, NULL, 0); /* TODO can this be removed? */
 
                                             /* TODO merge section and ps_section */
@@ -918,7 +1843,7 @@ void _print_ps(stream_t *stream)
                             /* This option is unknown to us, WTF? */
                             _log("Unknown option %s=%s found in the job\n", optionname, value);
                     }
-                    else if (nestinglevel == 0 && startswith(line->data, "%%EndFeature")) {
+                    else if (nestinglevel == 0 && dsc == DSC_END_FEATURE) {
                         /* End of feature */
                         infeature = 0;
                         /* If the option setting was replaced, it ends here,
@@ -927,7 +1852,7 @@ void _print_ps(stream_t *stream)
                         dstrclear(linesafterlastbeginfeature);
                     }
                     else if (nestinglevel == 0 && isdscjob && !prologfound &&
-                                startswith(line->data, "%%Begin")) {
+                                DSC_IS_BEGIN(dsc)) {
                         /* In some PostScript files (especially when generated
                         by "dvips" of TeX/LaTeX) the "%%BeginProlog" is
                         missing, so assume that it was before the current
@@ -945,9 +1870,18 @@ void _print_ps(stream_t *stream)
                         dstrprepend(line, tmp->data);
                         prologfound = 1;
                     }
-                    else if (nestinglevel == 0 && (
-                                startswith(line->data, "%RBINumCopies:") ||
-                                startswith(line->data, "%%RBINumCopies:"))) {
+                    else if (nestinglevel == 0 && skippage && dsc == DSC_TRAILER) {
+                        /* The last page was dropped, but the trailer is
+                           needed */
+                        fbufclear(psfifo);
+                        psfifolines = 0;
+                        skippage = 0;
+                    }
+                    else if (nestinglevel == 0 && dsc == DSC_PAGES && !isempty(pageranges)) {
+                        fix_pages_comment(line, inheader, pagesprinted);
+                        ignoreline = 1;
+                    }
+                    else if (nestinglevel == 0 && dsc == DSC_RBI_NUM_COPIES) {
                         p = strchr(line->data, ':') +1;
                         get_current_job()->rbinumcopies = atoi(p);
                         _log("Found %RBINumCopies: %d\n", get_current_job()->rbinumcopies);
@@ -964,7 +1898,9 @@ void _print_ps(stream_t *stream)
                         /* Collect coe in a "%%BeginFeature: ... %%EndFeature"
                         section, to get the values for a custom option
                         setting */
-                        dstrcat(linesafterlastbeginfeature, line->data);
+                        /* Only the beginning is needed to find the values */
+                        if (linesafterlastbeginfeature->len < ps_line_limit)
+                            dstrcat(linesafterlastbeginfeature, line->data);
 
                     if (inheader) {
                         if (!inprolog && !insetup) {
@@ -993,7 +1929,9 @@ void _print_ps(stream_t *stream)
                                     append_setup_section(tmp, optset, 1);
                                 if (pagesetupfound)
                                     append_page_setup_section(tmp, optset, 1);
-                                dstrinsert(psheader, line_start(psheader->data, insertoptions), tmp->data);
+                                if (early.pid && tmp->len && insertoptions < early.sent)
+                                    early_renderer_discard(&early);
+                                insert_fbuf(psheader, insertoptions, tmp->data);
 
                                 prologfound = 1;
                                 setupfound = 1;
@@ -1009,7 +1947,7 @@ void _print_ps(stream_t *stream)
                             _log("No page header or page header not DSC-conforming\n");
                         /* Stop buffering lines to search for options
                         placed not DSC-conforming */
-                        if (line_count(psfifo->data) >= MAX_LINES_FOR_PAGE_OPTIONS) {
+                        if (psfifolines >= MAX_LINES_FOR_PAGE_OPTIONS) {
                             _log("Stopping search for page header options\n");
                             passthru = 1;
                             /* If there comes a page header now, ignore it */
@@ -1019,7 +1957,9 @@ void _print_ps(stream_t *stream)
                         /* Insert PostScript option settings (options for the
                          * section "PageSetup" */
                         if (isdscjob && !pagesetupfound) {
-                            append_page_setup_section(psfifo, optset, 1);
+                            dstrclear(tmp);
+                            append_page_setup_section(tmp, optset, 1);
+                            fbufwrite(psfifo, tmp->data, tmp->len);
                             pagesetupfound = 1;
                         }
                     }
@@ -1042,14 +1982,27 @@ void _print_ps(stream_t *stream)
             the first "%%Page:..." and the current line belongs to
             an option setting, we have to copy the line also to the
             @psheader. */
-            if (optionsalsointoheader && (infeature || startswith(line->data, "%%EndFeature")))
-                dstrcat(psheader, line->data);
+            if (optionsalsointoheader && (infeature || dsc == DSC_END_FEATURE))
+                fbufwrite(psheader, line->data, line->len);
 
             /* Store or send the current line */
-            if (inheader && isdscjob) {
+            if (skippage && !inheader) {
+                /* Page is not selected, drop the line (and the binary data
+                   or embedded document which it introduces). With
+                   printprevpage set the line is processed once more. */
+                if (!printprevpage)
+                    forward_raw_data(stream, &rawsize, rawlines, &nestinglevel, NULL, NULL);
+            }
+            else if (inheader && isdscjob) {
                 /* We are still in the PostScript header, collect all lines
                 in @psheader */
-                dstrcat(psheader, line->data);
+                fbufwrite(psheader, line->data, line->len);
+                if (insertafterline)
+                    insertoptions = fbuflen(psheader);
+                forward_raw_data(stream, &rawsize, rawlines, &nestinglevel,
+                                 optionreplaced ? NULL : psheader, NULL);
+                if (early.pid && fbuflen(psheader) - early.sent >= STREAM_BUFSIZE)
+                    early_renderer_feed(&early, psheader);
             }
             else {
                 if (passthru && isdscjob) {
@@ -1059,38 +2012,47 @@ void _print_ps(stream_t *stream)
                          * command line can have changed, check it and close
                          * the renderer if needed
                          */
-                        if (rendererpid && !optionset_equal(optionset("currentpage"), optionset("previouspage"), 0)) {
+                        renderer_queue_advance(&rqueue, 0);
+                        if (rendererpid && !optionset_equal_renderer(optionset("currentpage"), optionset("previouspage"))) {
                             _log("Command line/JCL options changed, restarting renderer\n");
-                            retval = close_renderer_handle(rendererhandle, rendererpid);
-                            if (retval != EXIT_PRINTED)
-                                rip_die(retval, "Error closing renderer\n");
-                            rendererpid = 0;
+                            renderer_queue_retire(&rqueue, rendererhandle, &rendererpid);
                         }
+                        else if (rendererpid && !optionset_equal(optionset("currentpage"), optionset("previouspage"), 0))
+                            /* Their code is in the page setup already */
+                            _log("Only PostScript options changed, renderer keeps running\n");
                     }
 
                     /* Flush psfifo and send line directly to the renderer */
                     if (!rendererpid) {
                         /* No renderer running, start it */
-                        dstrcpy(tmp, psheader->data);
-                        dstrcat(tmp, psfifo->data);
-                        get_renderer_handle(tmp, &rendererhandle, &rendererpid);
+                        if (!early_renderer_adopt(&early, psheader, psfifo, &rendererhandle, &rendererpid))
+                            get_renderer_handle(psheader, psfifo, &rendererhandle, &rendererpid,
+                                                rqueue.finishing ? &rqueue.gated : NULL);
                         /* psfifo is sent out, flush it */
-                        dstrclear(psfifo);
+                        fbufclear(psfifo);
+                        psfifolines = 0;
                     }
 
-                    if (!isempty(psfifo->data)) {
+                    if (fbuflen(psfifo)) {
                         /* Send psfifo to renderer */
-                        fwrite(psfifo->data, psfifo->len, 1, rendererhandle);
+                        send_fbuf(psfifo, rendererhandle);
                         /* flush psfifo */
-                        dstrclear(psfifo);
+                        fbufclear(psfifo);
+                        psfifolines = 0;
                     }
 
                     /* Send line to renderer */
                     if (!printprevpage) {
                         fwrite(line->data, line->len, 1, rendererhandle);
+                        forward_raw_data(stream, &rawsize, rawlines, &nestinglevel,
+                                         NULL, optionreplaced ? NULL : rendererhandle);
+
+                        /* With mapped input the code up to the next DSC
+                           comment goes to the renderer in one block */
+                        stream_forward_to_comment(stream, rendererhandle);
 
                         while (stream_next_line(line, stream) > 0) {
-                            if (startswith(line->data, "%%")) {
+                            if (!stream->continued && startswith(line->data, "%%")) {
                                 _log("Found: %s", line->data);
                                 _log(" --> Continue DSC parsing now.\n\n");
                                 saved = 1;
@@ -1105,7 +2067,10 @@ void _print_ps(stream_t *stream)
                 }
                 else {
                     /* Push the line onto the stack to split up later */
-                    dstrcat(psfifo, line->data);
+                    fbufwrite(psfifo, line->data, line->len);
+                    psfifolines++;
+                    forward_raw_data(stream, &rawsize, rawlines, &nestinglevel,
+                                     optionreplaced ? NULL : psfifo, NULL);
                 }
             }
 
@@ -1135,10 +2100,16 @@ void _print_ps(stream_t *stream)
                 dstrclear(twolinesbefore);
                 dstrclear(line);
 
-                dstrcpy(tmp, psheader->data);
-                dstrcat(tmp, psfifo->data);
-                dstrclear(psfifo);
-                dstrclear(psheader);
+                dstrclear(tmp);
+                fbufread(psheader, tmp);
+                fbufread(psfifo, tmp);
+                fbufclear(psfifo);
+                psfifolines = 0;
+                fbufclear(psheader);
+
+                /* The file converter reads the rest of the input from
+                   stdin */
+                stream_unmap(stream);
 
                 /* Start the file conversion filter */
                 if (!fileconverter_pid)
@@ -1169,8 +2140,18 @@ void _print_ps(stream_t *stream)
 
     } while ((maxlines == 0 || linect < maxlines) && more_stuff != 0);
 
+    /* The last page was dropped and there is no trailer */
+    if (skippage) {
+        fbufclear(psfifo);
+        psfifolines = 0;
+    }
+
+    if (currentpage > 0 && !pagesprinted)
+        rip_die(EXIT_JOBERR, "None of the %d pages is selected by \"page-ranges=%s\"\n",
+                currentpage, pageranges);
+
     /* Some buffer still containing data? Send it out to the renderer */
-    if (more_stuff || inheader || !isempty(psfifo->data)) {
+    if (more_stuff || inheader || fbuflen(psfifo)) {
         /* Flush psfifo and send the remaining data to the renderer, this
         only happens with non-DSC-conforming jobs or non-Foomatic PPDs */
         if (more_stuff)
@@ -1196,40 +2177,37 @@ void _print_ps(stream_t *stream)
                 append_setup_section(tmp, optset, 1);
             if (pagesetupfound)
                 append_page_setup_section(tmp, optset, 1);
-            dstrinsert(psheader, line_start(psheader->data, insertoptions), tmp->data);
+            if (early.pid && tmp->len && insertoptions < early.sent)
+                early_renderer_discard(&early);
+            insert_fbuf(psheader, insertoptions, tmp->data);
 
             prologfound = 1;
             setupfound = 1;
             pagesetupfound = 1;
         }
 
-        if (rendererpid > 0 && !optionset_equal(optionset("currentpage"), optionset("previouspage"), 0)) {
+        if (rendererpid > 0 && !optionset_equal_renderer(optionset("currentpage"), optionset("previouspage"))) {
             _log("Command line/JCL options changed, restarting renderer\n");
-            retval = close_renderer_handle(rendererhandle, rendererpid);
-            if (retval != EXIT_PRINTED)
-                rip_die(retval, "Error closing renderer\n");
-            rendererpid = 0;
+            renderer_queue_retire(&rqueue, rendererhandle, &rendererpid);
         }
 
         if (!rendererpid) {
-            dstrcpy(tmp, psheader->data);
-            dstrcat(tmp, psfifo->data);
-            get_renderer_handle(tmp, &rendererhandle, &rendererpid);
+            if (!early_renderer_adopt(&early, psheader, psfifo, &rendererhandle, &rendererpid))
+                get_renderer_handle(psheader, psfifo, &rendererhandle, &rendererpid,
+                                    rqueue.finishing ? &rqueue.gated : NULL);
             /* We have sent psfifo now */
-            dstrclear(psfifo);
+            fbufclear(psfifo);
         }
 
-        if (psfifo->len) {
+        if (fbuflen(psfifo)) {
             /* Send psfifo to the renderer */
-            fwrite(psfifo->data, psfifo->len, 1, rendererhandle);
-            dstrclear(psfifo);
+            send_fbuf(psfifo, rendererhandle);
+            fbufclear(psfifo);
         }
 
         /* Print the rest of the input data */
-        if (more_stuff) {
-            while (stream_next_line(tmp, stream))
-                fwrite(tmp->data, tmp->len, 1, rendererhandle);
-        }
+        if (more_stuff)
+            stream_forward_rest(stream, rendererhandle);
     }
 
     /*  At every "%%Page:..." comment we have saved the PostScript state
@@ -1240,7 +2218,11 @@ void _print_ps(stream_t *stream)
         print $rendererhandle "foomatic-saved-state restore\n";
     } */
 
-    /* Close the renderer */
+    if (early.pid)
+        early_renderer_discard(&early);
+
+    /* Close the renderer, after the one which is still finishing */
+    renderer_queue_advance(&rqueue, 1);
     if (rendererpid) {
         retval = close_renderer_handle(rendererhandle, rendererpid);
         if (retval != EXIT_PRINTED)
@@ -1259,53 +2241,79 @@ void _print_ps(stream_t *stream)
     free_dstr(line);
     free_dstr(onelinebefore);
     free_dstr(twolinesbefore);
-    free_dstr(psheader);
-    free_dstr(psfifo);
+    free_fbuf(psheader);
+    free_fbuf(psfifo);
     free_dstr(tmp);
 }
 
 /*
  * Run the renderer command line (and if defined also the postpipe) and returns
- * a file handle for stuffing in the PostScript data.
+ * a file handle for stuffing in the PostScript data. The 'header' is sent
+ * with sendfile() out of its file, followed by 'fifo'. With 'gated' set, the
+ * output is held back until the gate of the renderer in '*gated' is opened.
  */
-void get_renderer_handle(const dstr_t *prepend, FILE **fd, pid_t *pid)
+void get_renderer_handle(fbuf_t *header, const fbuf_t *fifo, FILE **fd, pid_t *pid, pid_t *gated)
 {
-    pid_t kid3;
-    FILE *kid3in;
+    FILE *rendererin;
+
+    *pid = start_renderer(optionset("currentpage"), &rendererin, gated != NULL, 0);
+    if (gated)
+        *gated = *pid;
+
+    /* Feed the PostScript header and the FIFO contents. The header does not
+       change any more now, except for appended lines, so move it into its
+       file, it will be sent again on every restart of the renderer. */
+    if (header) {
+        fbufflush(header);
+        if (!fbufsend(header, pump_fileno(rendererin)))
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not send the PostScript header to the renderer\n");
+    }
+    if (fifo)
+        send_fbuf(fifo, rendererin);
+
+    /* We are the parent, return glob to the file handle */
+    *fd = rendererin;
+}
+
+/*
+ * Start the renderer with the command line for 'optset'. With 'gated' set,
+ * its output is held back until open_renderer_gate() gets called. With
+ * 'gsonly' set, only a Ghostscript command line is started (returns 0
+ * otherwise).
+ */
+static pid_t start_renderer(int optset, FILE **fd, int gated, int gsonly)
+{
+    pid_t renderer;
+    size_t start, end;
     dstr_t *cmdline = create_dstr();
 
     /* Build the command line and get the JCL commands */
-    build_commandline(optionset("currentpage"), cmdline, 0);
+    build_commandline(optset, cmdline, 0);
+    if (gsonly) {
+        extract_command(&start, &end, cmdline->data, "gs");
+        if (start == end) {
+            free_dstr(cmdline);
+            return 0;
+        }
+    }
     massage_gs_commandline(cmdline);
 
     _log("\nStarting renderer with command: \"%s\"\n", cmdline->data);
-    kid3 = start_process("kid3", exec_kid3, (void *)cmdline->data, &kid3in, NULL);
-    if (kid3 < 0)
-        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Cannot fork for kid3\n");
-
-    /* Feed the PostScript header and the FIFO contents */
-    if (prepend)
-        fwrite(prepend->data, prepend->len, 1, kid3in);
-
-    /* We are the parent, return glob to the file handle */
-    *fd = kid3in;
-    *pid = kid3;
+    renderer = start_renderer_command(cmdline->data, fd, gated, open_postpipe(), NULL);
+    if (renderer < 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Cannot start the renderer\n");
 
     free_dstr(cmdline);
+    return renderer;
 }
 
-/* Close the renderer process and wait until all kid processes finish */
+/* Close the renderer and wait until its output is sent, the
+   'rendererhandle' is NULL if the renderer read its input from our stdin */
 int close_renderer_handle(FILE *rendererhandle, pid_t rendererpid)
 {
-    int status;
-
     _log("\nClosing renderer\n");
-    fclose(rendererhandle);
+    if (rendererhandle)
+        fclose(rendererhandle);
 
-    status = wait_for_process(rendererpid);
-    if (WIFEXITED(status))
-        return WEXITSTATUS(status);
-    else
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+    return close_renderer(rendererpid);
 }
-
@@ -25,40 +25,58 @@
 #include "process.h"
 #include <unistd.h>
 #include "util.h"
+#include "pump.h"
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 int kidgeneration = 0;
 
 struct process {
     char name[64];
     pid_t pid;
-    int isgroup;
+    pid_t pgid;      /* its process group, 0 if it has none of its own */
+    pid_t pipeline;  /* for the other stages of a pipeline: its last stage */
 };
 
-#define MAX_CHILDS 4
+/* Room for the renderers of a PDF job working at the same time and the
+   other processes around them */
+#define MAX_CHILDS 24
 struct process procs[MAX_CHILDS] = {
-    { "", -1, 0 },
-    { "", -1, 0 },
-    { "", -1, 0 },
-    { "", -1, 0 }
+    [0 ... MAX_CHILDS -1] = { "", -1, 0, 0 }
 };
 
-void add_process(const char *name, int pid, int isgroup)
+/* Commands with more stages are run by the shell */
+#define MAX_PIPELINE 8
+
+static void add_pipeline_process(const char *name, int pid, pid_t pgid, pid_t pipeline)
 {
     int i;
     for (i = 0; i < MAX_CHILDS; i++) {
         if (procs[i].pid == -1) {
             strlcpy(procs[i].name, name, 64);
             procs[i].pid = pid;
-            procs[i].isgroup = isgroup;
+            procs[i].pgid = pgid;
+            procs[i].pipeline = pipeline;
             return;
         }
     }
     rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Didn't think there would be that many child processes... Exiting.\n");
 }
 
+void add_process(const char *name, int pid, int isgroup)
+{
+    add_pipeline_process(name, pid, isgroup ? pid : 0, 0);
+}
+
 int find_process(int pid)
 {
     int i;
@@ -75,17 +93,92 @@ void clear_proc_list()
         procs[i].pid = -1;
 }
 
+/* File descriptor which becomes readable when the process exits, -1 if the
+   system has no pidfd_open() */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Ask all child processes to terminate and wait for them together, for at
+ * most kill_grace_time seconds, halved with each generation so that the
+ * children of a child are gone before it gets killed. A process with its
+ * own process group is only gone when the whole group is. Only processes
+ * which are still running after that get killed.
+ */
 void kill_all_processes()
 {
-    int i;
+    struct pollfd fds[MAX_CHILDS];
+    int slot[MAX_CHILDS];
+    int i, n = 0, running = 0, groups;
+    long long deadline, left;
 
     for (i = 0; i < MAX_CHILDS; i++) {
         if (procs[i].pid == -1)
             continue;
-        _log("Killing %s\n", procs[i].name);
-        kill(procs[i].isgroup ? -procs[i].pid : procs[i].pid, 15);
-        sleep(1 << (3 - kidgeneration));
-        kill(procs[i].isgroup ? -procs[i].pid : procs[i].pid, 9);
+        /* The other stages of a pipeline are in the group of its last stage */
+        if (!procs[i].pipeline) {
+            _log("Killing %s\n", procs[i].name);
+            kill(procs[i].pgid ? -procs[i].pgid : procs[i].pid, SIGTERM);
+        }
+        fds[n].fd = open_pidfd(procs[i].pid);
+        fds[n].events = POLLIN;
+        slot[n++] = i;
+        running++;
+    }
+
+    deadline = now_ms() + (kill_grace_time > 0 ? (1000LL * kill_grace_time) >> kidgeneration : 0);
+    while (1) {
+        groups = 0;
+        for (i = 0; i < n; i++) {
+            if (procs[slot[i]].pid != -1 &&
+                waitpid(procs[slot[i]].pid, NULL, WNOHANG) != 0) {
+                _log("%s terminated\n", procs[slot[i]].name);
+                procs[slot[i]].pid = -1;
+                if (fds[i].fd >= 0)
+                    close(fds[i].fd);
+                fds[i].fd = -1;
+                running--;
+            }
+            /* The other members of its group are no children of ours */
+            if (procs[slot[i]].pid == -1 && procs[slot[i]].pgid) {
+                if (kill(-procs[slot[i]].pgid, 0) == 0)
+                    groups++;
+                else
+                    procs[slot[i]].pgid = 0;
+            }
+        }
+        if ((!running && !groups) || (left = deadline - now_ms()) <= 0)
+            break;
+
+        /* What has no pidfd is looked at again every 50 ms */
+        for (i = 0; i < n; i++)
+            if (((procs[slot[i]].pid != -1 && fds[i].fd < 0) ||
+                 (procs[slot[i]].pid == -1 && procs[slot[i]].pgid)) && left > 50)
+                left = 50;
+        poll(fds, n, left);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (fds[i].fd >= 0)
+            close(fds[i].fd);
+        if (procs[slot[i]].pid == -1 && !procs[slot[i]].pgid)
+            continue;
+        _log("Killing %s with SIGKILL\n", procs[slot[i]].name);
+        kill(procs[slot[i]].pgid ? -procs[slot[i]].pgid : procs[slot[i]].pid, SIGKILL);
     }
     clear_proc_list();
 }
@@ -100,10 +193,15 @@ static int _start_process(const char *name,
     int ret;
     FILE *in, *out;
 
-    if (pipe_in)
+    /* Our ends of the pipes must not stay open in other children */
+    if (pipe_in) {
         pipe(pfdin);
-    if (pipe_out)
+        fcntl(pfdin[1], F_SETFD, FD_CLOEXEC);
+    }
+    if (pipe_out) {
         pipe(pfdout);
+        fcntl(pfdout[0], F_SETFD, FD_CLOEXEC);
+    }
 
     _log("Starting process \"%s\" (generation %d)\n", name, kidgeneration +1);
 
@@ -139,6 +237,9 @@ static int _start_process(const char *name,
         if (createprocessgroup)
             setpgid(0, 0);
 
+        /* Only the main process lives with write errors instead */
+        signal(SIGPIPE, SIG_DFL);
+
         kidgeneration++;
 
         /* The subprocess list is only valid for the parent. Clear it. */
@@ -169,21 +270,266 @@ static int _start_process(const char *name,
     return pid;
 }
 
+/* Words which the shell treats specially when they start a command */
+static const char *shell_words[] = {
+    "!", "{", "}", "[[", "]]", "case", "do", "done", "elif", "else", "esac",
+    "fi", "for", "function", "if", "in", "select", "then", "time", "until",
+    "while", ".", ":", "alias", "break", "builtin", "cd", "command",
+    "continue", "eval", "exec", "exit", "export", "getopts", "hash", "local",
+    "read", "readonly", "return", "set", "shift", "source", "times", "trap",
+    "type", "ulimit", "umask", "unalias", "unset", "wait", NULL
+};
+
+/*
+ * Splits a command line which is a simple command or a pipeline of simple
+ * commands into the argument vectors of its stages. Only whitespace, '|',
+ * and quotes without anything to expand in them are understood, everything
+ * else needs the shell. 'buf' must hold strlen(cmd) +1 characters and
+ * 'args' 2 * strlen(cmd) +2 pointers, the results point into them.
+ * Returns the number of stages, 0 if the shell is needed.
+ */
+static int parse_command(const char *cmd, char *buf, char **args, char **argv[])
+{
+    const char *p = cmd;
+    char *dest = buf;
+    int stages = 0, words = 0, inword = 0, i;
+    char q;
+
+    argv[0] = args;
+    while (1) {
+        if (*p == ' ' || *p == '\t' || *p == '|' || *p == '\0') {
+            if (inword) {
+                *dest++ = '\0';
+                words++;
+                inword = 0;
+            }
+            if (*p == '|' || *p == '\0') {
+                if (!words || (p[0] == '|' && (p[1] == '|' || p[1] == '&')))
+                    return 0;
+                if (strchr(argv[stages][0], '='))
+                    return 0;
+                for (i = 0; shell_words[i]; i++)
+                    if (!strcmp(argv[stages][0], shell_words[i]))
+                        return 0;
+                *args++ = NULL;
+                if (++stages == MAX_PIPELINE && *p)
+                    return 0;
+                if (!*p)
+                    return stages;
+                argv[stages] = args;
+                words = 0;
+            }
+            p++;
+            continue;
+        }
+
+        if (!inword) {
+            *args++ = dest;
+            inword = 1;
+        }
+        if (*p == '\'' || *p == '\"') {
+            q = *p++;
+            for (; *p != q; p++) {
+                if (!*p || (q == '\"' && strchr("$`\\", *p)))
+                    return 0;
+                *dest++ = *p;
+            }
+            p++;
+        }
+        else if (strchr("\n&;<>()$`\\*?[]{}~#!", *p))
+            return 0;
+        else
+            *dest++ = *p++;
+    }
+}
+
 int exec_command(FILE *in, FILE *out, void *cmd)
 {
+    size_t len = strlen((const char *)cmd);
+    char *buf = malloc(len +1);
+    char **args = malloc((2 * len +2) * sizeof(char *));
+    char **argv[MAX_PIPELINE];
+
     if (in && dup2(fileno(in), fileno(stdin)) < 0)
         rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "%s: Could not dup stdin\n", (const char *)cmd);
     if (out && dup2(fileno(out), fileno(stdout)) < 0)
         rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "%s: Could not dup stdout\n", (const char *)cmd);
 
+    inherit_fd_paths((const char *)cmd, 1);
+
+    /* A simple command does not need the shell, if it cannot be executed
+       the shell reports the error */
+    if (parse_command((const char *)cmd, buf, args, argv) == 1)
+        execvp(argv[0][0], argv[0]);
+    free(buf);
+    free(args);
+
     execl(get_modern_shell(), get_modern_shell(), "-c", (const char *)cmd, (char *)NULL);
 
     _log("Error: Executing \"%s -c %s\" failed (%s).\n", get_modern_shell(), (const char *)cmd, strerror(errno));
     return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
 }
 
+/* pipe() with descriptors which are closed on exec and do not take the
+   place of stdin, stdout or stderr */
+static int spawn_pipe(int fds[2])
+{
+    int i, fd;
+
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        return 0;
+    for (i = 0; i < 2; i++) {
+        if (fds[i] > 2)
+            continue;
+        fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+        close(fds[i]);
+        fds[i] = fd;
+    }
+    if (fds[0] < 0 || fds[1] < 0) {
+        if (fds[0] >= 0) close(fds[0]);
+        if (fds[1] >= 0) close(fds[1]);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Starts the stages of a parsed command with posix_spawn(), connected by
+ * pipes, in a new process group. This saves the fork() of foomatic-rip and
+ * the shell. Returns the pid of the last stage, or -1 if a stage could not
+ * be started, nothing is left running then.
+ */
+static pid_t spawn_command(const char *name, char **argv[], int stages,
+                           FILE **pipe_in, FILE **pipe_out)
+{
+    pid_t pids[MAX_PIPELINE];
+    int pfdin[2] = { -1, -1 }, pfdout[2] = { -1, -1 }, pfd[2];
+    int infd, outfd = -1, i, started, err = 0;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t sigpipe;
+
+    if (pipe_in && !spawn_pipe(pfdin))
+        return -1;
+    if (pipe_out && !spawn_pipe(pfdout)) {
+        if (pipe_in) {
+            close(pfdin[0]);
+            close(pfdin[1]);
+        }
+        return -1;
+    }
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigpipe);
+
+    infd = pfdin[0];
+    for (started = 0; started < stages; started++) {
+        if (started == stages -1)
+            outfd = pfdout[1];
+        else if (!spawn_pipe(pfd)) {
+            err = errno;
+            if (started > 0)
+                close(infd);
+            break;
+        }
+        else
+            outfd = pfd[1];
+
+        posix_spawn_file_actions_init(&actions);
+        if (infd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, infd, 0);
+        if (outfd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, outfd, 1);
+        /* Files named as /dev/fd/<n> are passed to this stage only, a
+           dup2() onto itself clears FD_CLOEXEC in the child */
+        for (i = 0; argv[started][i]; i++) {
+            const char *word = argv[started][i];
+            int fd;
+            while ((fd = next_fd_path(&word)) >= 0)
+                posix_spawn_file_actions_adddup2(&actions, fd, fd);
+        }
+        err = posix_spawnp(&pids[started], argv[started][0], &actions, &attr,
+                           argv[started], environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (started > 0)
+            close(infd);
+        if (started < stages -1) {
+            close(outfd);
+            infd = pfd[0];
+        }
+        if (err) {
+            if (started < stages -1)
+                close(infd);
+            break;
+        }
+        if (started == 0)
+            posix_spawnattr_setpgroup(&attr, pids[0]);
+    }
+    posix_spawnattr_destroy(&attr);
+
+    if (err) {
+        _log("Could not start %s: %s\n", argv[started][0], strerror(err));
+        if (started > 0) {
+            kill(-pids[0], SIGKILL);
+            for (i = 0; i < started; i++)
+                waitpid(pids[i], NULL, 0);
+        }
+        if (pipe_in) {
+            close(pfdin[0]);
+            close(pfdin[1]);
+        }
+        if (pipe_out) {
+            close(pfdout[0]);
+            close(pfdout[1]);
+        }
+        return -1;
+    }
+
+    if (pipe_in) {
+        close(pfdin[0]);
+        *pipe_in = fdopen(pfdin[1], "w");
+        if (!*pipe_in)
+            _log("fdopen: %s\n", strerror(errno));
+    }
+    if (pipe_out) {
+        close(pfdout[1]);
+        *pipe_out = fdopen(pfdout[0], "r");
+        if (!*pipe_out)
+            _log("fdopen: %s\n", strerror(errno));
+    }
+
+    /* The process group is the one of the first stage */
+    add_pipeline_process(name, pids[stages -1], pids[0], 0);
+    for (i = 0; i < stages -1; i++)
+        add_pipeline_process(name, pids[i], 0, pids[stages -1]);
+
+    return pids[stages -1];
+}
+
 int start_system_process(const char *name, const char *command, FILE **fdin, FILE **fdout)
 {
+    size_t len = strlen(command);
+    char *buf = malloc(len +1);
+    char **args = malloc((2 * len +2) * sizeof(char *));
+    char **argv[MAX_PIPELINE];
+    int stages;
+    pid_t pid = -1;
+
+    /* Only command lines which really need the shell are run by it */
+    if ((stages = parse_command(command, buf, args, argv)) > 0) {
+        _log("Starting process \"%s\" (generation %d)\n", name, kidgeneration +1);
+        pid = spawn_command(name, argv, stages, fdin, fdout);
+    }
+    free(buf);
+    free(args);
+    if (pid >= 0)
+        return pid;
+
     return _start_process(name, exec_command, (void*)command, fdin, fdout, 1);
 }
 
@@ -192,6 +538,39 @@ int start_process(const char *name, int (*proc_func)(FILE *, FILE *, void *), vo
     return _start_process(name, proc_func, user_arg, fdin, fdout, 0);
 }
 
+/* waitpid(), which keeps the pumps going while the process runs */
+static pid_t wait_pid(pid_t pid, int *status)
+{
+    pid_t ret;
+    int fd;
+
+    if (!pump_active())
+        return waitpid(pid, status, 0);
+
+    fd = open_pidfd(pid);
+    while ((ret = waitpid(pid, status, WNOHANG)) == 0) {
+        if (fd < 0 || !pump_wait(fd, POLLIN))
+            pump_sleep(50);
+    }
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+/* The status of a pipeline is the one of its last stage, the others are
+   only waited for */
+static void wait_for_pipeline(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < MAX_CHILDS; i++) {
+        if (procs[i].pid != -1 && procs[i].pipeline == pid) {
+            wait_pid(procs[i].pid, NULL);
+            procs[i].pid = -1;
+        }
+    }
+}
+
 int wait_for_process(int pid)
 {
     int i;
@@ -203,7 +582,7 @@ int wait_for_process(int pid)
         return -1;
     }
 
-    waitpid(procs[i].pid, &status, 0);
+    wait_pid(procs[i].pid, &status);
     if (WIFEXITED(status))
         _log("%s exited with status %d\n", procs[i].name, WEXITSTATUS(status));
     else if (WIFSIGNALED(status))
@@ -211,9 +590,39 @@ int wait_for_process(int pid)
 
     /* remove from process list */
     procs[i].pid = -1;
+    wait_for_pipeline(pid);
     return status;
 }
 
+/* Like wait_for_process(), but does not block: returns 0 if the process is
+   still running, otherwise 1 with its status in 'status' */
+int check_process(int pid, int *status)
+{
+    int i;
+    pid_t ret;
+
+    i = find_process(pid);
+    if (i < 0) {
+        _log("No such process \"%d\"", pid);
+        *status = -1;
+        return 1;
+    }
+
+    ret = waitpid(procs[i].pid, status, WNOHANG);
+    if (ret == 0)
+        return 0;
+    if (ret < 0)
+        *status = -1;
+    else if (WIFEXITED(*status))
+        _log("%s exited with status %d\n", procs[i].name, WEXITSTATUS(*status));
+    else if (WIFSIGNALED(*status))
+        _log("%s received signal %d\n", procs[i].name, WTERMSIG(*status));
+
+    procs[i].pid = -1;
+    wait_for_pipeline(pid);
+    return 1;
+}
+
 int run_system_process(const char *name, const char *command)
 {
     int pid = start_system_process(name, command, NULL, NULL);
@@ -29,6 +29,7 @@
 #include <sys/wait.h>
 
 pid_t start_process(const char *name, int (*proc_func)(), void *user_arg, FILE **fdin, FILE **fdout);
+int exec_command(FILE *in, FILE *out, void *cmd);
 pid_t start_system_process(const char *name, const char *command, FILE **fdin, FILE **fdout);
 
 /* returns command's return status (see waitpid(2)) */
@@ -41,6 +42,7 @@ pid_t create_pipe_process(const char *name,
                           size_t alreadyread_len);
 
 int wait_for_process(int pid);
+int check_process(int pid, int *status); /* 0 if still running */
 
 void kill_all_processes();
 
@@ -0,0 +1,598 @@
+/* pump.c
+ *
+ * This file is part of foomatic-rip.
+ *
+ * Foomatic-rip is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Foomatic-rip is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "foomaticrip.h"
+#include "util.h"
+#include "pump.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#define PUMP_BUFSIZE 65536
+
+enum pump_source_type {
+    SOURCE_DATA,
+    SOURCE_FILE,
+    SOURCE_STREAM
+};
+
+typedef struct pump_source {
+    enum pump_source_type type;
+    char *data;             /* SOURCE_DATA */
+    int fd;                 /* SOURCE_FILE */
+    FILE *in;               /* SOURCE_STREAM */
+    int plain;              /* SOURCE_STREAM: a file, which is always ready */
+    off_t offset;
+    size_t count;           /* SOURCE_DATA, SOURCE_FILE: bytes left */
+    struct pump_source *next;
+} pump_source_t;
+
+/* A descriptor of a pump in the epoll set */
+typedef struct pump_fd {
+    pump_t *pump;
+    int fd;                 /* -1 if there is none */
+    int events;             /* what it is registered for, 0 if it is not */
+} pump_fd_t;
+
+struct pump {
+    FILE *out;              /* feeder: the pipe it writes into */
+    FILE *in;               /* drain: the pipe it reads from */
+    pump_fd_t outfd, infd;  /* 'infd' is the one of the current source of a
+                               feeder */
+    pump_source_t *sources, **tail;
+    int closing;            /* pump_close() has been called */
+    int ready;              /* the current source can be read */
+    int nosendfile;
+    char *buf;
+    const char *pending;    /* data which is about to be written */
+    size_t pendinglen;
+    int teefd;
+    int *teeresult;
+    void (*handler)(void *arg, const char *data, size_t len);
+    void *arg;
+    int dead;
+    struct pump *next;
+};
+
+static int epfd = -1;
+static pump_t *pumps = NULL;
+static int dispatching = 0;
+
+int pump_active()
+{
+    pump_t *p;
+
+    for (p = pumps; p; p = p->next)
+        if (!p->dead)
+            return 1;
+    return 0;
+}
+
+/* Register 'pf' for 'events', or remove it from the epoll set if they
+   are 0 */
+static void pump_watch(pump_fd_t *pf, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (pf->fd < 0 || pf->events == events)
+        return;
+    if (!events)
+        op = EPOLL_CTL_DEL;
+    else if (!pf->events)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = pf;
+    if (epoll_ctl(epfd, op, pf->fd, &ev) != 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not watch a pipe: %s\n", strerror(errno));
+    pf->events = events;
+}
+
+static pump_t * create_pump()
+{
+    pump_t *p;
+
+    if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not create the epoll set: %s\n", strerror(errno));
+    if (!(p = calloc(1, sizeof(pump_t))) || !(p->buf = malloc(PUMP_BUFSIZE)))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not allocate a pump\n");
+
+    p->outfd.pump = p->infd.pump = p;
+    p->outfd.fd = p->infd.fd = -1;
+    p->tail = &p->sources;
+    p->teefd = -1;
+    p->next = pumps;
+    pumps = p;
+    return p;
+}
+
+/* Pumps which are done are freed when nothing refers to them anymore, a
+   feeder not before pump_close() */
+static void free_dead_pumps()
+{
+    pump_t **pp = &pumps, *p;
+
+    while ((p = *pp)) {
+        if (p->dead && (p->handler || p->closing)) {
+            *pp = p->next;
+            free(p->buf);
+            free(p);
+        }
+        else
+            pp = &p->next;
+    }
+}
+
+static void discard_source(pump_source_t *src)
+{
+    if (src->type == SOURCE_STREAM)
+        fclose(src->in);
+    free(src->data);
+    free(src);
+}
+
+static void drop_source(pump_t *p)
+{
+    pump_source_t *src = p->sources;
+
+    if (src->type == SOURCE_STREAM && p->infd.fd == fileno(src->in)) {
+        pump_watch(&p->infd, 0);
+        p->infd.fd = -1;
+    }
+    p->sources = src->next;
+    if (!p->sources)
+        p->tail = &p->sources;
+    p->ready = 0;
+    discard_source(src);
+}
+
+static void finish_pump(pump_t *p)
+{
+    pump_watch(&p->outfd, 0);
+    pump_watch(&p->infd, 0);
+    while (p->sources)
+        drop_source(p);
+    if (p->out)
+        fclose(p->out);
+    if (p->in)
+        fclose(p->in);
+    p->out = p->in = NULL;
+    p->dead = 1;
+    if (!dispatching)
+        free_dead_pumps();
+}
+
+/* Data from the sources which was read into the buffer, to be written */
+static void feeder_pending(pump_t *p, const char *data, size_t len)
+{
+    p->pending = data;
+    p->pendinglen = len;
+
+    /* A failing copy must not stop the feeding */
+    if (p->teefd >= 0 && !write_all(p->teefd, data, len)) {
+        _log("Could not write the copy of the data: %s\n", strerror(errno));
+        p->teefd = -1;
+        *p->teeresult = -1;
+    }
+}
+
+static void feeder_failed(pump_t *p, const char *what)
+{
+    _log("Stopped feeding a child process, %s: %s\n", what, strerror(errno));
+    if (p->teefd >= 0)
+        *p->teeresult = -1;
+    finish_pump(p);
+}
+
+/* Write as much as the pipe takes without waiting, then watch for what
+   the feeder needs next */
+static void feeder_step(pump_t *p)
+{
+    pump_source_t *src;
+    ssize_t n;
+    size_t len;
+
+    for (;;) {
+        if (p->pendinglen) {
+            if ((n = write(p->outfd.fd, p->pending, p->pendinglen)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN) {
+                    feeder_failed(p, "writing");
+                    return;
+                }
+                pump_watch(&p->infd, 0);
+                pump_watch(&p->outfd, EPOLLOUT);
+                return;
+            }
+            p->pending += n;
+            p->pendinglen -= n;
+            continue;
+        }
+
+        if (!(src = p->sources)) {
+            if (p->closing) {
+                if (p->teefd >= 0)
+                    *p->teeresult = 1;
+                finish_pump(p);
+            }
+            else
+                pump_watch(&p->outfd, 0);
+            return;
+        }
+
+        switch (src->type) {
+        case SOURCE_DATA:
+            len = src->count < PUMP_BUFSIZE ? src->count : PUMP_BUFSIZE;
+            memcpy(p->buf, &src->data[src->offset], len);
+            src->offset += len;
+            if (!(src->count -= len))
+                drop_source(p);
+            feeder_pending(p, p->buf, len);
+            break;
+
+        case SOURCE_FILE:
+            if (!src->count) {
+                drop_source(p);
+                break;
+            }
+            len = src->count < (1 << 20) ? src->count : (1 << 20);
+            if (!p->nosendfile && p->teefd < 0) {
+                if ((n = sendfile(p->outfd.fd, src->fd, &src->offset, len)) > 0) {
+                    src->count -= n;
+                    break;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                    pump_watch(&p->outfd, EPOLLOUT);
+                    return;
+                }
+                if (n < 0 && errno == EINTR)
+                    break;
+                if (n < 0 && errno != EINVAL && errno != ENOSYS) {
+                    feeder_failed(p, "sending a file");
+                    return;
+                }
+                if (n < 0) {
+                    p->nosendfile = 1;
+                    break;
+                }
+                /* the file is shorter than expected */
+                drop_source(p);
+                break;
+            }
+            if ((n = pread(src->fd, p->buf, len < PUMP_BUFSIZE ? len : PUMP_BUFSIZE,
+                           src->offset)) < 0 && errno == EINTR)
+                break;
+            if (n <= 0) {
+                if (n < 0) {
+                    feeder_failed(p, "reading a file");
+                    return;
+                }
+                drop_source(p);
+                break;
+            }
+            src->offset += n;
+            src->count -= n;
+            feeder_pending(p, p->buf, n);
+            break;
+
+        case SOURCE_STREAM:
+            if (p->infd.fd != fileno(src->in)) {
+                p->infd.fd = fileno(src->in);
+                p->infd.events = 0;
+            }
+            if (!src->plain && !p->ready) {
+                pump_watch(&p->outfd, 0);
+                pump_watch(&p->infd, EPOLLIN);
+                return;
+            }
+            p->ready = 0;
+            if ((n = read(p->infd.fd, p->buf, PUMP_BUFSIZE)) < 0 && errno == EINTR)
+                break;
+            if (n < 0)
+                _log("Could not read the data for a child process: %s\n", strerror(errno));
+            if (n <= 0) {
+                drop_source(p);
+                break;
+            }
+            feeder_pending(p, p->buf, n);
+            break;
+        }
+    }
+}
+
+static void drain_step(pump_t *p)
+{
+    void (*handler)(void *arg, const char *data, size_t len);
+    void *arg;
+    ssize_t n;
+
+    if ((n = read(p->infd.fd, p->buf, PUMP_BUFSIZE)) < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n < 0)
+        _log("Could not read the output of a child process: %s\n", strerror(errno));
+    if (n > 0) {
+        p->handler(p->arg, p->buf, n);
+        return;
+    }
+    handler = p->handler;
+    arg = p->arg;
+    finish_pump(p);
+    handler(arg, NULL, 0);
+}
+
+pump_t * pump_feeder(FILE *out)
+{
+    pump_t *p = create_pump();
+    int flags, fd;
+
+    /* A stream from pump_fopen() gets replaced by a plain one, what has
+       been written into it goes out first */
+    if ((fd = pump_fileno(out)) != fileno(out)) {
+        fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        if (fclose(out) != 0 || fd < 0 || !(out = fdopen(fd, "w")))
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not take over a pipe for a pump\n");
+    }
+
+    p->out = out;
+    p->outfd.fd = fileno(out);
+    if ((flags = fcntl(p->outfd.fd, F_GETFL)) < 0 ||
+        fcntl(p->outfd.fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not make a pipe non-blocking\n");
+    return p;
+}
+
+static pump_source_t * add_source(pump_t *p, enum pump_source_type type)
+{
+    pump_source_t *src = calloc(1, sizeof(pump_source_t));
+
+    if (!src)
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not allocate a pump\n");
+    src->type = type;
+    if (p->dead)
+        return src;
+    *p->tail = src;
+    p->tail = &src->next;
+    return src;
+}
+
+void pump_add_data(pump_t *p, const char *data, size_t len)
+{
+    pump_source_t *src;
+
+    if (!len)
+        return;
+    src = add_source(p, SOURCE_DATA);
+    if (!(src->data = malloc(len)))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not allocate a pump\n");
+    memcpy(src->data, data, len);
+    src->count = len;
+    if (p->dead)
+        discard_source(src);
+    else
+        feeder_step(p);
+}
+
+void pump_add_file(pump_t *p, int fd, off_t offset, size_t count)
+{
+    pump_source_t *src = add_source(p, SOURCE_FILE);
+
+    src->fd = fd;
+    src->offset = offset;
+    src->count = count;
+    if (p->dead)
+        discard_source(src);
+    else
+        feeder_step(p);
+}
+
+void pump_add_stream(pump_t *p, FILE *in)
+{
+    pump_source_t *src = add_source(p, SOURCE_STREAM);
+    struct stat st;
+
+    src->in = in;
+    /* epoll does not take files, they are always ready */
+    src->plain = fstat(fileno(in), &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+    if (p->dead)
+        discard_source(src);
+    else
+        feeder_step(p);
+}
+
+void pump_tee(pump_t *p, int fd, int *result)
+{
+    p->teefd = fd;
+    p->teeresult = result;
+    *result = 0;
+}
+
+void pump_close(pump_t *p)
+{
+    p->closing = 1;
+    if (p->dead)
+        free_dead_pumps();
+    else
+        feeder_step(p);
+}
+
+pump_t * pump_drain(FILE *in, void (*handler)(void *arg, const char *data, size_t len),
+                    void *arg)
+{
+    pump_t *p = create_pump();
+
+    p->in = in;
+    p->infd.fd = fileno(in);
+    p->handler = handler;
+    p->arg = arg;
+    pump_watch(&p->infd, EPOLLIN);
+    return p;
+}
+
+void pump_cancel(pump_t *p)
+{
+    p->closing = 1;
+    if (!p->dead)
+        finish_pump(p);
+    else if (!dispatching)
+        free_dead_pumps();
+}
+
+/* Handle what is ready, waiting at most 'timeout' milliseconds for it */
+static void pump_dispatch(int timeout)
+{
+    struct epoll_event ev[16];
+    pump_fd_t *pf;
+    int n, i;
+
+    if ((n = epoll_wait(epfd, ev, 16, timeout)) < 0) {
+        if (errno != EINTR)
+            rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "epoll_wait failed: %s\n", strerror(errno));
+        return;
+    }
+
+    dispatching = 1;
+    for (i = 0; i < n; i++) {
+        pf = (pump_fd_t *)ev[i].data.ptr;
+        if (pf->pump->dead)
+            continue;
+        if (pf->pump->handler)
+            drain_step(pf->pump);
+        else {
+            if (pf == &pf->pump->infd)
+                pf->pump->ready = 1;
+            feeder_step(pf->pump);
+        }
+    }
+    dispatching = 0;
+    free_dead_pumps();
+}
+
+int pump_wait(int fd, short events)
+{
+    struct pollfd fds[2];
+
+    /* The pumps are not run from within a pump */
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[1].fd = epfd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, pumps && !dispatching ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (fds[0].revents)
+            return 1;
+        if (fds[1].revents)
+            pump_dispatch(0);
+    }
+}
+
+void pump_run(const int *done)
+{
+    while (!*done && pump_active())
+        pump_dispatch(-1);
+}
+
+void pump_sleep(int ms)
+{
+    if (pump_active() && !dispatching)
+        pump_dispatch(ms);
+    else
+        poll(NULL, 0, ms);
+}
+
+void pump_poll()
+{
+    if (pump_active() && !dispatching)
+        pump_dispatch(0);
+}
+
+/* Streams from pump_fopen() */
+typedef struct pump_stream {
+    FILE *f;
+    FILE *out;
+    struct pump_stream *next;
+} pump_stream_t;
+
+static pump_stream_t *streams = NULL;
+
+static ssize_t pump_stream_write(void *cookie, const char *data, size_t size)
+{
+    return write_all(fileno((FILE *)cookie), data, size) ? (ssize_t)size : 0;
+}
+
+static int pump_stream_close(void *cookie)
+{
+    pump_stream_t **pp, *s;
+
+    for (pp = &streams; (s = *pp); pp = &s->next) {
+        if (s->out == (FILE *)cookie) {
+            *pp = s->next;
+            free(s);
+            break;
+        }
+    }
+    return fclose((FILE *)cookie);
+}
+
+FILE * pump_fopen(FILE *out)
+{
+    static const cookie_io_functions_t funcs = { NULL, pump_stream_write, NULL, pump_stream_close };
+    pump_stream_t *s;
+    int flags;
+
+    if ((flags = fcntl(fileno(out), F_GETFL)) < 0 ||
+        fcntl(fileno(out), F_SETFL, flags | O_NONBLOCK) < 0 ||
+        !(s = malloc(sizeof(pump_stream_t))))
+        return NULL;
+    if (!(s->f = fopencookie(out, "w", funcs))) {
+        free(s);
+        return NULL;
+    }
+    s->out = out;
+    s->next = streams;
+    streams = s;
+    return s->f;
+}
+
+int pump_fileno(FILE *f)
+{
+    pump_stream_t *s;
+
+    for (s = streams; s; s = s->next)
+        if (s->f == f)
+            return fileno(s->out);
+    return fileno(f);
+}
@@ -0,0 +1,71 @@
+/* pump.h
+ *
+ * This file is part of foomatic-rip.
+ *
+ * Foomatic-rip is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Foomatic-rip is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef pump_h
+#define pump_h
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* The data which goes into the child processes and comes out of them is
+   moved by "pumps" of the main process, with one epoll set, whenever
+   foomatic-rip would otherwise wait for a descriptor or a process. A
+   feeder writes its sources one after the other into a pipe, a drain
+   hands what comes out of a pipe to a handler. */
+typedef struct pump pump_t;
+
+/* Feeder for the pipe 'out', which is made non-blocking. 'out' is closed
+   after the last source when pump_close() has been called. It may also be
+   a stream from pump_fopen(), which is closed right away then. */
+pump_t * pump_feeder(FILE *out);
+void pump_add_data(pump_t *p, const char *data, size_t len); /* copies the data */
+void pump_add_file(pump_t *p, int fd, off_t offset, size_t count); /* 'fd' must stay open */
+void pump_add_stream(pump_t *p, FILE *in); /* up to EOF, 'in' is closed then */
+/* Everything the feeder reads goes also into 'fd', '*result' becomes 1
+   when all of it has been sent and -1 if writing into 'fd' failed */
+void pump_tee(pump_t *p, int fd, int *result);
+void pump_close(pump_t *p);
+
+/* Drain for the pipe 'in': 'handler' gets the data as it comes and a 'len'
+   of 0 at the end of file, 'in' is closed after that */
+pump_t * pump_drain(FILE *in, void (*handler)(void *arg, const char *data, size_t len),
+                    void *arg);
+
+/* Stop a pump and close its pipe */
+void pump_cancel(pump_t *p);
+
+int pump_active();
+/* Keep the pumps going until 'fd' is ready for 'events' (POLLIN or
+   POLLOUT), returns 0 on error */
+int pump_wait(int fd, short events);
+/* ... until '*done' is set */
+void pump_run(const int *done);
+/* ... for at most 'ms' milliseconds */
+void pump_sleep(int ms);
+/* Do what can be done without waiting */
+void pump_poll();
+
+/* Stream for writing into the pipe 'out', which is made non-blocking:
+   while it is full, the pumps are kept going. Closing it closes 'out'. */
+FILE * pump_fopen(FILE *out);
+/* The descriptor of 'f', also of a stream from pump_fopen() */
+int pump_fileno(FILE *f);
+
+#endif
@@ -25,40 +25,255 @@
 
 #include <signal.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "foomaticrip.h"
 #include "util.h"
 #include "process.h"
 #include "options.h"
+#include "renderer.h"
+#include "cache.h"
+#include "pump.h"
+
+/* The capabilities of the Ghostscript in 'gs_caps_path', as of the given
+   modification time and size of the executable */
+static gs_caps_t gs_caps;
+static char gs_caps_path[PATH_MAX] = "";
+static time_t gs_caps_mtime;
+static off_t gs_caps_size;
+
+/* Parse the output of the probe or the capability file, the lines are
+   "<key> <value>" */
+static void parse_gs_caps(gs_caps_t *caps, char *data, time_t *mtime, off_t *size)
+{
+    char *line, *value, *next;
+
+    for (line = data; line && *line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+        if (!(value = strchr(line, ' ')))
+            continue;
+        *value++ = '\0';
+
+        if (!strcmp(line, "mtime"))
+            *mtime = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "size"))
+            *size = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "redirection"))
+            caps->output_redirection = atoi(value);
+        else if (!strcmp(line, "revision"))
+            caps->revision = atoi(value);
+        else if (!strcmp(line, "threads"))
+            caps->threads = atoi(value);
+        else if (!strcmp(line, "devices"))
+            snprintf(caps->devices, sizeof(caps->devices), " %s ", value);
+    }
+}
 
 /*
- * Check whether we have a Ghostscript version with redirection of the standard
- * output of the PostScript programs via '-sstdout=%stderr'
+ * Run Ghostscript to find out what it can do. Whether it redirects the
+ * standard output of the PostScript programs via '-sstdout=%stderr' is
+ * checked by printing "hello", if it does not understand that, nothing else
+ * is known. The revision, the output devices and whether it renders with
+ * several threads (since 8.64) follow, one line each.
  */
-int test_gs_output_redirection()
+static void probe_gs(gs_caps_t *caps)
 {
     char gstestcommand[PATH_MAX];
-    char output[10] = "";
+    dstr_t *output = create_dstr();
+    char buf[4096];
+    size_t n;
+    time_t mtime;
+    off_t size;
+    FILE *pd;
 
-    snprintf(gstestcommand, PATH_MAX, "%s -dQUIET -dPARANOIDSAFER -dNOPAUSE "
-             "-dBATCH -dNOMEDIAATTRS -sDEVICE=ps2write -sstdout=%%stderr "
-             "-sOutputFile=/dev/null -c '(hello\n) print flush' 2>&1", gspath);
+    memset(caps, 0, sizeof(gs_caps_t));
 
-    FILE *pd = popen(gstestcommand, "r");
+    snprintf(gstestcommand, PATH_MAX, "%s -dQUIET -dPARANOIDSAFER -dNOPAUSE "
+             "-dBATCH -dNOMEDIAATTRS -sDEVICE=nullpage -sstdout=%%stderr "
+             "-sOutputFile=/dev/null -c '(hello\n) print "
+             "(revision ) print revision =only (\n) print "
+             "(threads ) print revision 864 ge {1} {0} ifelse =only (\n) print "
+             "(devices) print devicenames {( ) print =only} forall (\n) print "
+             "flush' 2>&1", gspath);
+
+    pd = popen(gstestcommand, "r");
     if (!pd) {
         _log("Failed to execute ghostscript!\n");
-        return 0;
+        free_dstr(output);
+        return;
     }
 
-    fread(output, 1, 10, pd);
+    while ((n = fread(buf, 1, sizeof(buf), pd)) > 0)
+        dstrncat(output, buf, n);
     pclose(pd);
 
-    if (startswith(output, "hello"))
-        return 1;
+    if (startswith(output->data, "hello\n")) {
+        caps->output_redirection = 1;
+        parse_gs_caps(caps, output->data + 6, &mtime, &size);
+    }
+    free_dstr(output);
+}
 
-    return 0;
+/* The executable which gspath refers to, 0 if it is not found */
+static int find_gs(char *path, struct stat *st)
+{
+    char dir[PATH_MAX] = "";
+    int n;
+
+    if (strchr(gspath, '/'))
+        strlcpy(path, gspath, PATH_MAX);
+    else if (find_in_path(gspath, getenv("PATH") ? getenv("PATH") : "", dir) && *dir) {
+        n = snprintf(path, PATH_MAX, "%s/%s", dir, gspath);
+        if (n < 0 || n >= PATH_MAX)
+            return 0;
+    }
+    else
+        return 0;
+
+    return stat(path, st) == 0;
+}
+
+/* The file with the capabilities of the Ghostscript executable 'path': a
+   hidden file in the cache directory, or in the temporary directory if
+   there is no cache. It is not a cache entry, so that it neither needs nor
+   counts against cache_size. 0 if the name does not fit. */
+static int gs_caps_filename(char *name, const char *path)
+{
+    cache_key_t hash;
+    char key[65];
+    char uid[32];
+    int n;
+
+    /* Different users must not share the file in the temporary directory */
+    snprintf(uid, sizeof(uid), "%u", (unsigned)geteuid());
+    cache_key_init(&hash);
+    cache_key_add(&hash, path, strlen(path) +1);
+    cache_key_add(&hash, uid, strlen(uid));
+    cache_key_final(&hash, key);
+
+    n = snprintf(name, PATH_MAX, "%s/.foomatic-gs-%s",
+                 isempty(cache_dir) ? temp_dir() : cache_dir, key);
+    return n >= 0 && n < PATH_MAX;
+}
+
+/* Read the capabilities from the file, if they are for this executable */
+static int read_gs_caps(const char *name, const struct stat *st)
+{
+    gs_caps_t caps;
+    char buf[16384];
+    time_t mtime = 0;
+    off_t size = -1;
+    struct stat fst;
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        return 0;
+    /* Only trust our own file */
+    if (fstat(fd, &fst) != 0 || fst.st_uid != geteuid()) {
+        close(fd);
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) -1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    /* A file from before "threads" was probed does not count */
+    memset(&caps, 0, sizeof(gs_caps_t));
+    caps.threads = -1;
+    parse_gs_caps(&caps, buf, &mtime, &size);
+    if (mtime != st->st_mtime || size != st->st_size || caps.threads < 0)
+        return 0;
+
+    gs_caps = caps;
+    return 1;
+}
+
+/* Write the file under a temporary name and rename it, so that other jobs
+   never read half of it */
+static void write_gs_caps(const char *name, const struct stat *st)
+{
+    char tmpname[PATH_MAX];
+    dstr_t *data;
+    int fd, n;
+
+    n = snprintf(tmpname, PATH_MAX, "%s.XXXXXX", name);
+    if (n < 0 || n >= PATH_MAX)
+        return;
+    if ((fd = mkstemp(tmpname)) < 0) {
+        _log("Could not write %s: %s\n", name, strerror(errno));
+        return;
+    }
+
+    data = create_dstr();
+    dstrcatf(data, "mtime %lld\nsize %lld\nredirection %d\nrevision %d\nthreads %d\n",
+             (long long)st->st_mtime, (long long)st->st_size,
+             gs_caps.output_redirection, gs_caps.revision, gs_caps.threads);
+    if (gs_caps.devices[0])
+        dstrcatf(data, "devices %s\n", gs_caps.devices + 1);
+    if (!write_all(fd, data->data, data->len) || close(fd) != 0 ||
+        rename(tmpname, name) != 0) {
+        _log("Could not write %s: %s\n", name, strerror(errno));
+        unlink(tmpname);
+    }
+    free_dstr(data);
+}
+
+/*
+ * What the Ghostscript in gspath can do. It is only run when its
+ * executable changed since the last time, the result is kept in a file
+ * for the next jobs.
+ */
+const gs_caps_t * gs_capabilities()
+{
+    char path[PATH_MAX], name[PATH_MAX];
+    struct stat st;
+
+    if (!find_gs(path, &st)) {
+        /* Let the shell find it, without caching */
+        probe_gs(&gs_caps);
+        gs_caps_path[0] = '\0';
+        return &gs_caps;
+    }
+
+    if (!strcmp(path, gs_caps_path) && st.st_mtime == gs_caps_mtime &&
+        st.st_size == gs_caps_size)
+        return &gs_caps;
+
+    if (!gs_caps_filename(name, path))
+        probe_gs(&gs_caps);
+    else if (!read_gs_caps(name, &st)) {
+        probe_gs(&gs_caps);
+        write_gs_caps(name, &st);
+    }
+    _log("Ghostscript %s: revision %d%s%s\n", path, gs_caps.revision,
+         gs_caps.output_redirection ? ", -sstdout=%stderr" : "",
+         gs_caps.threads ? ", -dNumRenderingThreads" : "");
+
+    strlcpy(gs_caps_path, path, PATH_MAX);
+    gs_caps_mtime = st.st_mtime;
+    gs_caps_size = st.st_size;
+    return &gs_caps;
+}
+
+int gs_has_device(const char *name)
+{
+    const gs_caps_t *caps = gs_capabilities();
+    char word[128];
+    int n;
+
+    if (!caps->devices[0])
+        return 1;
+    n = snprintf(word, sizeof(word), " %s ", name);
+    return n > 0 && n < sizeof(word) && strstr(caps->devices, word) != NULL;
 }
 
 /*
@@ -68,17 +283,37 @@ int test_gs_output_redirection()
  */
 void massage_gs_commandline(dstr_t *cmd)
 {
-    int gswithoutputredirection = test_gs_output_redirection();
+    const gs_caps_t *caps;
+    int gswithoutputredirection;
     size_t start, end;
     dstr_t *gscmd, *cmdcopy;
+    const char *p;
+    char device[128];
+    long cpus;
 
     extract_command(&start, &end, cmd->data, "gs");
     if (start == end) /* cmd doesn't call ghostscript */
         return;
 
+    caps = gs_capabilities();
+    gswithoutputredirection = caps->output_redirection;
+
     gscmd = create_dstr();
     dstrncpy(gscmd, &cmd->data[start], end - start);
 
+    /* A device which this Ghostscript does not have makes it fail right
+       away, say why in the log */
+    if ((p = strstr(gscmd->data, "-sDEVICE=")) &&
+        sscanf(p + 9, "%127[^ \t'\"]", device) == 1 && !gs_has_device(device))
+        _log("Ghostscript %s has no output device \"%s\"\n", gspath, device);
+
+    /* Let it render the bands of a page with one thread per processor,
+       unless the command line says how many; it must come before the input
+       file, right after "gs" */
+    if (caps->threads && !strstr(gscmd->data, "-dNumRenderingThreads") &&
+        (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+        dstrinsertf(gscmd, 2, " -dNumRenderingThreads=%ld", cpus);
+
     /* If Ghostscript does not support redirecting the standard output
        of the PostScript program to standard error with '-sstdout=%stderr', sen
        the job output data to fd 3; errors will be on 2(stderr) and job ps
@@ -137,30 +372,6 @@ void massage_gs_commandline(dstr_t *cmd)
     dstrreplace(cmd, "echo", echopath, 0); /* TODO search for \wecho\w */
 }
 
-char * read_line(FILE *stream, size_t *readbytes)
-{
-    char *line;
-    size_t alloc = 64, len = 0;
-    int c;
-
-    line = malloc(alloc);
-
-    while ((c = fgetc(stream)) != EOF) {
-        if (len >= alloc -1) {
-            alloc *= 2;
-            line = realloc(line, alloc);
-        }
-        line[len] = (char)c;
-        len++;
-        if (c == '\n')
-            break;
-    }
-
-    line[len] = '\0';
-    *readbytes = len;
-    return line;
-}
-
 void write_binary_data(FILE *stream, const char *data, size_t bytes)
 {
     int i;
@@ -171,21 +382,32 @@ void write_binary_data(FILE *stream, const char *data, size_t bytes)
 }
 
 /*
- * Read all lines containing 'jclstr' from 'stream' (actually, one more) and
- * return them in a zero terminated array.
+ * Read all lines containing 'jclstr' from the 'len' bytes at 'data' (actually,
+ * one more) and return them in a zero terminated array. '*used' is set to
+ * the number of bytes in them.
  */
-static char ** read_jcl_lines(FILE *stream, const char *jclstr,
-			      size_t *readbinarybytes)
+static char ** read_jcl_lines(const char *data, size_t len, const char *jclstr,
+			      size_t *readbinarybytes, size_t *used)
 {
     char *line;
+    const char *nl;
     char **result;
-    size_t alloc = 8, cnt = 0;
+    size_t alloc = 8, cnt = 0, n;
 
     result = malloc(alloc * sizeof(char *));
+    *used = 0;
 
     /* read from the renderer output until the first non-JCL line appears */
-    while ((line = read_line(stream, readbinarybytes)))
+    for (;;)
     {
+        nl = memchr(&data[*used], '\n', len - *used);
+        n = nl ? (size_t)(nl - &data[*used]) + 1 : len - *used;
+        line = malloc(n +1);
+        memcpy(line, &data[*used], n);
+        line[n] = '\0';
+        *readbinarybytes = n;
+        *used += n;
+
         if (cnt >= alloc -1)
         {
             alloc *= 2;
@@ -204,6 +426,24 @@ static char ** read_jcl_lines(FILE *stream, const char *jclstr,
     return result;
 }
 
+/* Whether 'len' bytes of renderer output hold the complete JCL header of
+   the driver, as read_jcl_lines() reads it */
+static int jcl_lines_complete(char *data, size_t len, const char *jclstr)
+{
+    char *line = data, *nl;
+    int jcl;
+
+    while ((nl = memchr(line, '\n', len - (line - data)))) {
+        *nl = '\0';
+        jcl = strstr(line, jclstr) != NULL;
+        *nl = '\n';
+        if (!jcl)
+            return 1;
+        line = nl +1;
+    }
+    return 0;
+}
+
 static int jcl_keywords_equal(const char *jclline1, const char *jclline2,
                               const char *jclstr)
 {
@@ -336,131 +576,300 @@ static int write_merged_jcl_options(FILE *stream,
     return 1;
 }
 
-void log_jcl()
+static void log_jcl(char **prepend, const dstr_t *append)
 {
     char **opt;
 
     _log("JCL: %s", jclbegin);
-    if (jclprepend)
-        for (opt = jclprepend; *opt; opt++)
+    if (prepend)
+        for (opt = prepend; *opt; opt++)
             _log("%s\n", *opt);
 
-    _log("<job data> %s\n\n", jclappend->data);
+    _log("<job data> %s\n\n", append->data);
 }
 
-int exec_kid4(FILE *in, FILE *out, void *user_arg)
+
+/* The output of a renderer, which foomatic-rip reads while it does other
+   things: it goes to 'out' (the postpipe or a buffer of the PDF renderers)
+   with the JCL around it. The output of a gated renderer is held back
+   in a spill file until the gate is opened. The JCL is the one of the
+   option set for which the renderer was started, later pages may already
+   have changed it when the gate opens. */
+typedef struct renderer_output {
+    pid_t pid;
+    pump_t *pump;
+    int eof;                /* all of the output has been read */
+    FILE *out;
+    struct cache_entry *entry; /* the output goes also into this entry */
+    int gated;
+    char **jclprepend;      /* copies of jclprepend and jclappend */
+    dstr_t *jclappend;
+    int buffered;           /* 'held' has been created */
+    spillfile_t held;
+    char *jclstr;           /* while the output before the end of the JCL */
+    dstr_t *start;          /* header of the driver is collected in 'start' */
+    int driverjcl;          /* the driver has put JCL around the output */
+    int failed;             /* the output could not be passed on */
+    struct renderer_output *next;
+} renderer_output_t;
+
+static renderer_output_t *outputs = NULL;
+
+static renderer_output_t * find_output(pid_t pid)
 {
-    FILE *fileh = open_postpipe();
-    int driverjcl;
-    size_t readbinarybytes;
+    renderer_output_t *r;
 
-    log_jcl();
+    for (r = outputs; r; r = r->next)
+        if (r->pid == pid)
+            return r;
+    rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "No renderer with pid %d\n", pid);
+    return NULL;
+}
+
+static void free_output(renderer_output_t *r)
+{
+    renderer_output_t **rp;
+
+    for (rp = &outputs; *rp; rp = &(*rp)->next) {
+        if (*rp == r) {
+            *rp = r->next;
+            break;
+        }
+    }
+    if (r->pump)
+        pump_cancel(r->pump);
+    if (r->buffered)
+        close_spillfile(&r->held);
+    free(r->jclstr);
+    if (r->start)
+        free_dstr(r->start);
+    argv_free(r->jclprepend);
+    if (r->jclappend)
+        free_dstr(r->jclappend);
+    free(r);
+}
+
+/* The output may go out now: start with the JCL */
+static void start_output(renderer_output_t *r)
+{
+    size_t pos;
+
+    log_jcl(r->jclprepend, r->jclappend);
 
     /* wrap the JCL around the job data, if there are any options specified...
      * Should the driver already have inserted JCL commands we merge our JCL
      * header with the one from the driver */
-    if (argv_count(jclprepend) > 0)
+    if (argv_count(r->jclprepend) > 0)
     {
-        if (!isspace(jclprepend[0][0]))
+        if (!isspace(r->jclprepend[0][0]))
         {
-            char *jclstr, **jclheader;
-            size_t pos;
-
-            pos = strcspn(jclprepend[0], " \t\n\r");
-            jclstr = malloc(pos +1);
-            strncpy(jclstr, jclprepend[0], pos);
-            jclstr[pos] = '\0';
-
-            jclheader = read_jcl_lines(in, jclstr, &readbinarybytes);
-
-            driverjcl = write_merged_jcl_options(fileh,
-                                                 jclheader,
-                                                 jclprepend,
-                                                 readbinarybytes,
-                                                 jclstr);
-
-            free(jclstr);
-            argv_free(jclheader);
+            /* The output is collected until the driver's JCL header is
+               complete */
+            pos = strcspn(r->jclprepend[0], " \t\n\r");
+            r->jclstr = malloc(pos +1);
+            strncpy(r->jclstr, r->jclprepend[0], pos);
+            r->jclstr[pos] = '\0';
+            r->start = create_dstr();
         }
         else
             /* No merging of JCL header possible, simply prepend it */
-            argv_write(fileh, jclprepend, "\n");
+            argv_write(r->out, r->jclprepend, "\n");
     }
+}
 
-    /* The job data */
-    copy_file(fileh, in, NULL, 0);
+/* Write the JCL header merged with the one of the driver, followed by the
+   rest of the output collected so far */
+static void merge_driver_jcl(renderer_output_t *r)
+{
+    char **jclheader;
+    size_t readbinarybytes, used;
+
+    jclheader = read_jcl_lines(r->start->data, r->start->len, r->jclstr,
+                               &readbinarybytes, &used);
+    r->driverjcl = write_merged_jcl_options(r->out,
+                                            jclheader,
+                                            r->jclprepend,
+                                            readbinarybytes,
+                                            r->jclstr);
+    argv_free(jclheader);
+
+    if (used < r->start->len &&
+        fwrite(&r->start->data[used], r->start->len - used, 1, r->out) != 1)
+        r->failed = 1;
+
+    free(r->jclstr);
+    r->jclstr = NULL;
+    free_dstr(r->start);
+    r->start = NULL;
+}
+
+static void send_output(renderer_output_t *r, const char *data, size_t len)
+{
+    if (r->start) {
+        dstrncat(r->start, data, len);
+        if (jcl_lines_complete(r->start->data, r->start->len, r->jclstr))
+            merge_driver_jcl(r);
+    }
+    else if (fwrite(data, len, 1, r->out) != 1)
+        r->failed = 1;
+}
+
+static void end_output(renderer_output_t *r)
+{
+    if (r->start)
+        merge_driver_jcl(r);
 
     /* A JCL trailer */
-    if (argv_count(jclprepend) > 0 && !driverjcl)
-        fwrite(jclappend->data, jclappend->len, 1, fileh);
+    if (argv_count(r->jclprepend) > 0 && !r->driverjcl)
+        fwrite(r->jclappend->data, r->jclappend->len, 1, r->out);
 
-    fclose(in);
-    if (fclose(fileh) != 0)
-    {
-        _log("error closing postpipe\n");
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+    if (fflush(r->out) != 0 || ferror(r->out)) {
+        _log("Could not send the renderer output\n");
+        r->failed = 1;
     }
-
-    return EXIT_PRINTED;
 }
 
-int exec_kid3(FILE *in, FILE *out, void *user_arg)
+/* Handler for the pump which reads the renderer output */
+static void renderer_output_data(void *arg, const char *data, size_t len)
 {
-    dstr_t *commandline;
-    int kid4;
-    FILE *kid4in;
-    int status;
+    renderer_output_t *r = (renderer_output_t *)arg;
 
-    commandline = create_dstr();
-    dstrcpy(commandline, (const char *)user_arg);
-
-    kid4 = start_process("kid4", exec_kid4, NULL, &kid4in, NULL);
-    if (kid4 < 0) {
-        free_dstr(commandline);
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+    if (!len) {
+        r->pump = NULL;
+        r->eof = 1;
+        if (!r->gated)
+            end_output(r);
+        return;
     }
 
-    if (in && dup2(fileno(in), fileno(stdin)) < 0) {
-        _log("kid3: Could not dup stdin\n");
-        fclose(kid4in);
-        free_dstr(commandline);
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+    /* A failing cache must not stop the job */
+    if (r->entry && !r->entry->failed && !write_all(r->entry->fd, data, len)) {
+        _log("Could not write to the cache: %s\n", strerror(errno));
+        r->entry->failed = 1;
     }
-    if (dup2(fileno(kid4in), fileno(stdout)) < 0) {
-        _log("kid3: Could not dup stdout to kid4\n");
-        fclose(kid4in);
-        free_dstr(commandline);
-        return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+
+    if (!r->gated)
+        send_output(r, data, len);
+    else if (!r->failed &&
+             ((!r->buffered && !(r->buffered = create_spillfile(&r->held))) ||
+              !spillwrite(&r->held, data, len))) {
+        _log("Could not buffer the renderer output\n");
+        r->failed = 1;
     }
+}
+
+pid_t start_renderer_command(const char *cmd, FILE **in, int gated, FILE *out,
+                             struct cache_entry *entry)
+{
+    dstr_t *commandline;
+    renderer_output_t *r;
+    FILE *rendererin, *rendererout;
+    pid_t pid;
+    int savederr = -1;
+
+    commandline = create_dstr();
+    dstrcpy(commandline, cmd);
     if (debug)
     {
-        if (!redirect_log_to_stderr()) {
-            fclose(kid4in);
-            free_dstr(commandline);
-            return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
-        }
-
         /* Save the data supposed to be fed into the renderer also into a file*/
         dstrprepend(commandline, "tee $(mktemp " LOG_FILE "-XXXXXX.ps) | ( ");
         dstrcat(commandline, ")");
-    }
 
-    /* Actually run the thing */
-    status = run_system_process("renderer", commandline->data);
+        /* The messages of the renderer go into the log */
+        savederr = redirect_stderr_to_log();
+    }
 
-    if (in)
-        fclose(in);
-    fclose(kid4in);
-    fclose(stdin);
-    fclose(stdout);
+    /* Actually run the thing, its output comes to this process */
+    pid = start_system_process("renderer", commandline->data,
+                               in ? &rendererin : NULL, &rendererout);
+    restore_stderr(savederr);
     free_dstr(commandline);
+    if (pid < 0) {
+        if (entry)
+            cache_store_abort(entry);
+        return -1;
+    }
+    if (in && !(*in = pump_fopen(rendererin)))
+        rip_die(EXIT_PRNERR_NORETRY_BAD_SETTINGS, "Could not open the input of the renderer\n");
+
+    r = calloc(1, sizeof(renderer_output_t));
+    r->pid = pid;
+    r->out = out;
+    r->entry = entry;
+    r->gated = gated;
+    r->jclprepend = argv_copy(jclprepend);
+    r->jclappend = create_dstr();
+    dstrcpy(r->jclappend, jclappend->data);
+    r->next = outputs;
+    outputs = r;
+
+    if (!gated)
+        start_output(r);
+    r->pump = pump_drain(rendererout, renderer_output_data, r);
+    return pid;
+}
+
+void open_renderer_gate(pid_t pid)
+{
+    renderer_output_t *r = find_output(pid);
+    char buf[65536];
+    ssize_t n;
+    int fd;
+
+    if (!r->gated)
+        return;
+    r->gated = 0;
+    start_output(r);
+
+    /* What the renderer has produced so far */
+    if (r->buffered) {
+        fd = spillfinish(&r->held);
+        r->buffered = 0;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            send_output(r, buf, n);
+        if (n < 0) {
+            _log("Could not read the buffered renderer output\n");
+            r->failed = 1;
+        }
+        close(fd);
+    }
+    if (r->eof)
+        end_output(r);
+}
+
+void discard_renderer_output(pid_t pid)
+{
+    renderer_output_t *r = find_output(pid);
+
+    if (r->entry)
+        cache_store_abort(r->entry);
+    free_output(r);
+
+    /* Its exit status does not matter, it has lost its output pipe */
+    wait_for_process(pid);
+}
+
+/* Complete the cache entry and turn the exit status of the renderer into
+   the one of foomatic-rip */
+static int finish_output(renderer_output_t *r, int status)
+{
+    int failed = r->failed;
+
+    if (r->entry) {
+        if (!failed && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            !r->entry->failed)
+            cache_store_commit(r->entry);
+        else
+            cache_store_abort(r->entry);
+    }
+    free_output(r);
 
     if (WIFEXITED(status)) {
         switch (WEXITSTATUS(status)) {
             case 0:  /* Success! */
-                /* wait for postpipe/output child */
-                wait_for_process(kid4);
-                _log("kid3 finished\n");
+                if (failed)
+                    return EXIT_PRNERR_NORETRY_BAD_SETTINGS;
+                _log("Renderer finished\n");
                 return EXIT_PRINTED;
             case 1:
                 _log("Possible error on renderer command line or PostScript error. Check options.");
@@ -489,3 +898,41 @@ int exec_kid3(FILE *in, FILE *out, void *user_arg)
     return EXIT_PRNERR;
 }
 
+int close_renderer(pid_t pid)
+{
+    renderer_output_t *r = find_output(pid);
+
+    open_renderer_gate(pid);
+    pump_run(&r->eof);
+    return finish_output(r, wait_for_process(pid));
+}
+
+int check_renderer(pid_t pid, int *retval)
+{
+    renderer_output_t *r = find_output(pid);
+    int status;
+
+    pump_poll();
+    if (!r->eof || !check_process(pid, &status))
+        return 0;
+    *retval = finish_output(r, status);
+    return 1;
+}
+
+int send_cached_output(int fd, FILE *out)
+{
+    renderer_output_t r;
+    char buf[65536];
+    ssize_t n;
+
+    /* Sent right away, with the current JCL */
+    memset(&r, 0, sizeof(r));
+    r.out = out;
+    r.jclprepend = jclprepend;
+    r.jclappend = jclappend;
+    start_output(&r);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        send_output(&r, buf, n);
+    end_output(&r);
+    return n == 0 && !r.failed;
+}
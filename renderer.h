@@ -24,8 +24,42 @@
 #ifndef renderer_h
 #define renderer_h
 
+/* What the Ghostscript in gspath can do */
+typedef struct gs_caps {
+    int output_redirection; /* understands -sstdout=%stderr */
+    int revision;           /* like 952 for 9.52, 0 if not known */
+    int threads;            /* understands -dNumRenderingThreads */
+    char devices[4096];     /* " dev1 dev2 ... ", empty if not known */
+} gs_caps_t;
+
+const gs_caps_t * gs_capabilities();
+/* 1 if it has the output device 'name', also if its devices are not known */
+int gs_has_device(const char *name);
+
 void massage_gs_commandline(dstr_t *cmd);
-int exec_kid3(FILE *in, FILE *out, void *user_arg);
+
+struct cache_entry;
+
+/* Run the renderer command line 'cmd', with 'in' set the stream for
+   feeding it is stored there (otherwise it reads our stdin). Its output
+   goes with the JCL around it to 'out', with 'gated' only when the gate
+   gets opened. With 'entry' the output goes also into that cache entry,
+   which is completed if the renderer succeeds. Returns its pid, -1 if it
+   could not be started. */
+pid_t start_renderer_command(const char *cmd, FILE **in, int gated, FILE *out,
+                             struct cache_entry *entry);
+void open_renderer_gate(pid_t pid);
+/* Throw the output away and wait for the renderer */
+void discard_renderer_output(pid_t pid);
+/* Wait until the output of the renderer is sent and the renderer has
+   exited, returns the exit status for foomatic-rip (EXIT_PRINTED if it
+   succeeded). check_renderer() does not wait, it returns 0 if the renderer
+   is not done and 1 with that status in 'retval' otherwise. */
+int close_renderer(pid_t pid);
+int check_renderer(pid_t pid, int *retval);
+
+/* Send renderer output from the cache with the JCL to 'out', 0 on error */
+int send_cached_output(int fd, FILE *out);
 
 #endif
 
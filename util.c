@@ -23,12 +23,23 @@
 
 #include "util.h"
 #include "foomaticrip.h"
+#include "pump.h"
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 
 const char* shellescapes = "|<>&!$\'\"#*?()[]{}";
@@ -86,7 +97,7 @@ int endswith(const char *str, const char *postfix)
         return 0;
 
     pstr = &str[slen - plen];
-    return strcmp(str, postfix) == 0;
+    return strcmp(pstr, postfix) == 0;
 }
 
 const char * skip_whitespace(const char *str)
@@ -446,6 +457,21 @@ size_t argv_count(char **argv)
     return cnt;
 }
 
+char ** argv_copy(char **argv)
+{
+    size_t i, cnt = argv_count(argv);
+    char **copy;
+
+    if (!argv)
+        return NULL;
+
+    copy = malloc((cnt +1) * sizeof(char *));
+    for (i = 0; i < cnt; i++)
+        copy[i] = strdup(argv[i]);
+    copy[cnt] = NULL;
+    return copy;
+}
+
 void argv_free(char **argv)
 {
     char **p;
@@ -621,7 +647,7 @@ void dstrncat(dstr_t *ds, const char *src, size_t n)
         ds->data = realloc(ds->data, ds->alloc);
     }
 
-    strncpy(&ds->data[ds->len], src, n);
+    memcpy(&ds->data[ds->len], src, n);
     ds->len = needed;
     ds->data[ds->len] = '\0';
 }
@@ -760,7 +786,6 @@ void dstrprepend(dstr_t *ds, const char *str)
 
 void dstrinsert(dstr_t *ds, int idx, const char *str)
 {
-    char * copy = strdup(ds->data);
     size_t len = strlen(str);
 
     if (idx >= ds->len)
@@ -772,16 +797,13 @@ void dstrinsert(dstr_t *ds, int idx, const char *str)
         do {
             ds->alloc *= 2;
         } while (ds->len + len >= ds->alloc);
-        free(ds->data);
-        ds->data = malloc(ds->alloc);
+        ds->data = realloc(ds->data, ds->alloc);
     }
 
-    strncpy(ds->data, copy, idx);
-    ds->data[idx] = '\0';
-    strcat(ds->data, str);
-    strcat(ds->data, &copy[idx]);
+    /* Move the tail with memmove(), ds may contain binary data */
+    memmove(&ds->data[idx + len], &ds->data[idx], ds->len - idx + 1);
+    memcpy(&ds->data[idx], str, len);
     ds->len += len;
-    free(copy);
 }
 
 void dstrinsertf(dstr_t *ds, int idx, const char *str, ...)
@@ -903,6 +925,667 @@ void dstrtrim_right(dstr_t *ds)
 
 
 
+/*
+ * Anonymous files and file buffers
+ */
+
+/* Unnamed file in temp_dir(), on disk unless that is a tmpfs */
+static int create_disk_file()
+{
+    char path[PATH_MAX];
+    int fd;
+
+#ifdef O_TMPFILE
+    if ((fd = open(temp_dir(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0)
+        return fd;
+#endif
+
+    snprintf(path, PATH_MAX, "%s/foomatic-XXXXXX", temp_dir());
+    if ((fd = mkstemp(path)) < 0) {
+        _log("Could not create temporary file: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int create_anon_file()
+{
+#ifdef MFD_CLOEXEC
+    int fd;
+
+    if ((fd = memfd_create("foomatic-rip", MFD_CLOEXEC)) >= 0)
+        return fd;
+#endif
+    return create_disk_file();
+}
+
+int create_temp_file(size_t size)
+{
+    if (size > temp_memory_limit)
+        return create_disk_file();
+    return create_anon_file();
+}
+
+int spool_to_temp_file(int infd, const char *alreadyread, size_t len)
+{
+    char buf[65536];
+    size_t size = 0;
+    ssize_t n;
+    int fd, diskfd, inmemory = 1;
+
+    if ((fd = create_anon_file()) < 0)
+        return -1;
+
+    if (len && !write_all(fd, alreadyread, len))
+        goto error;
+    size = len;
+
+    for (;;) {
+        /* Move the data to disk when it gets too big for memory */
+        if (size > temp_memory_limit && inmemory) {
+            if ((diskfd = create_disk_file()) < 0)
+                goto error;
+            if (!copy_fd_range(diskfd, fd, 0, size)) {
+                close(diskfd);
+                goto error;
+            }
+            close(fd);
+            fd = diskfd;
+            inmemory = 0;
+        }
+
+        if ((n = read_some(infd, buf, sizeof(buf))) < 0)
+            goto error;
+        if (n == 0)
+            break;
+        if (!write_all(fd, buf, n))
+            goto error;
+        size += n;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+
+error:
+    _log("Could not write temporary file: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+}
+
+int create_spillfile(spillfile_t *sf)
+{
+    sf->size = 0;
+    sf->ondisk = 0;
+    if ((sf->memfd = create_anon_file()) < 0)
+        return 0;
+    if ((sf->diskfd = create_disk_file()) < 0) {
+        close(sf->memfd);
+        sf->memfd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+void close_spillfile(spillfile_t *sf)
+{
+    if (sf->memfd >= 0)
+        close(sf->memfd);
+    if (sf->diskfd >= 0)
+        close(sf->diskfd);
+    sf->memfd = sf->diskfd = -1;
+}
+
+int spillwrite(spillfile_t *sf, const char *data, size_t len)
+{
+    /* Move the data to disk when it gets too big for memory */
+    if (!sf->ondisk && sf->size + len > temp_memory_limit) {
+        if (!copy_fd_range(sf->diskfd, sf->memfd, 0, sf->size) ||
+            ftruncate(sf->memfd, 0) != 0) {
+            _log("Could not move the buffered data to disk: %s\n", strerror(errno));
+            return 0;
+        }
+        sf->ondisk = 1;
+    }
+    if (!write_all(sf->ondisk ? sf->diskfd : sf->memfd, data, len))
+        return 0;
+    sf->size += len;
+    return 1;
+}
+
+int spillfromfd(spillfile_t *sf, int fd)
+{
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read_some(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 || !spillwrite(sf, buf, n))
+            return 0;
+    }
+    return 1;
+}
+
+void spillclear(spillfile_t *sf)
+{
+    ftruncate(sf->memfd, 0);
+    ftruncate(sf->diskfd, 0);
+    lseek(sf->memfd, 0, SEEK_SET);
+    lseek(sf->diskfd, 0, SEEK_SET);
+    sf->size = 0;
+    sf->ondisk = 0;
+}
+
+static ssize_t spillfile_cookie_write(void *cookie, const char *data, size_t size)
+{
+    return spillwrite((spillfile_t *)cookie, data, size) ? (ssize_t)size : 0;
+}
+
+FILE * spillfopen(spillfile_t *sf)
+{
+    static const cookie_io_functions_t funcs = { NULL, spillfile_cookie_write, NULL, NULL };
+
+    return fopencookie(sf, "w", funcs);
+}
+
+int spillfinish(spillfile_t *sf)
+{
+    struct stat st;
+    int fd;
+
+    /* The writer may have been another process, the data is on disk if
+       anything is */
+    if (fstat(sf->diskfd, &st) != 0)
+        st.st_size = 0;
+    if (st.st_size > 0) {
+        fd = sf->diskfd;
+        close(sf->memfd);
+    }
+    else {
+        fd = sf->memfd;
+        close(sf->diskfd);
+    }
+    sf->memfd = sf->diskfd = -1;
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+const char * fd_path(int fd, char *path)
+{
+    snprintf(path, PATH_MAX, "/dev/fd/%d", fd);
+    return path;
+}
+
+int next_fd_path(const char **str)
+{
+    const char *p;
+    char *end;
+    long fd;
+
+    while ((p = strstr(*str, "/dev/fd/"))) {
+        fd = strtol(p + 8, &end, 10);
+        *str = end > p + 8 ? end : p + 8;
+        if (end > p + 8 && fd > 2 && fd < INT_MAX)
+            return (int)fd;
+    }
+    return -1;
+}
+
+void inherit_fd_paths(const char *str, int inherit)
+{
+    int fd;
+
+    while ((fd = next_fd_path(&str)) >= 0)
+        fcntl(fd, F_SETFD, inherit ? 0 : FD_CLOEXEC);
+}
+
+ssize_t read_some(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    for (;;) {
+        /* While the pumps are running, nothing may block */
+        if (pump_active() && !pump_wait(fd, POLLIN))
+            return -1;
+        if ((n = read(fd, buf, len)) >= 0 || (errno != EINTR && errno != EAGAIN))
+            return n;
+        if (errno == EAGAIN && !pump_wait(fd, POLLIN))
+            return -1;
+    }
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR || (errno == EAGAIN && pump_wait(fd, POLLOUT)))
+                continue;
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int copy_fd_range(int outfd, int infd, off_t offset, size_t count)
+{
+    char buf[65536];
+    ssize_t n;
+
+#ifdef __linux__
+    while (count) {
+        if ((n = sendfile(outfd, infd, &offset, count)) <= 0) {
+            if (n < 0 && (errno == EINTR || (errno == EAGAIN && pump_wait(outfd, POLLOUT))))
+                continue;
+            break;
+        }
+        count -= n;
+    }
+    if (!count)
+        return 1;
+#endif
+
+    /* sendfile() not supported for these descriptors */
+    while (count) {
+        if ((n = pread(infd, buf, count < sizeof(buf) ? count : sizeof(buf), offset)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (!write_all(outfd, buf, n))
+            return 0;
+        offset += n;
+        count -= n;
+    }
+    return 1;
+}
+
+int copy_fd(int outfd, int infd)
+{
+    char buf[65536];
+    ssize_t n;
+#ifdef __linux__
+    int usesplice = 1, usesendfile = 1;
+#endif
+
+    for (;;) {
+        /* While the pumps are running, nothing may block */
+        if (pump_active() && !pump_wait(infd, POLLIN))
+            return 0;
+#ifdef __linux__
+        /* splice() needs a pipe on one side, sendfile() a file to read from,
+           fall back to the next method when the descriptors do not fit */
+        if (usesplice) {
+            if ((n = splice(infd, NULL, outfd, NULL, 1 << 20,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0 &&
+                errno == EINVAL) {
+                usesplice = 0;
+                continue;
+            }
+        }
+        else if (usesendfile) {
+            if ((n = sendfile(outfd, infd, NULL, 1 << 20)) < 0 &&
+                (errno == EINVAL || errno == ENOSYS)) {
+                usesendfile = 0;
+                continue;
+            }
+        }
+        else
+#endif
+        if ((n = read(infd, buf, sizeof(buf))) > 0 && !write_all(outfd, buf, n))
+            return 0;
+
+        if (n == 0)
+            return 1;
+        /* The input is ready, so the output is full */
+        if (n < 0 && errno == EAGAIN) {
+            if (!pump_wait(outfd, POLLOUT) || !pump_wait(infd, POLLIN))
+                return 0;
+            continue;
+        }
+        if (n < 0 && errno != EINTR)
+            return 0;
+    }
+}
+
+/* Chunks which are kept for reuse after clearing a file buffer */
+#define FBUF_MAX_SPARE_CHUNKS 16
+
+fbuf_t * create_fbuf()
+{
+    fbuf_t *fb = malloc(sizeof(fbuf_t));
+    fb->fd = -1;
+    fb->filelen = 0;
+    fb->first = fb->last = NULL;
+    fb->memlen = 0;
+    fb->memlimit = 0;
+    fb->spare = NULL;
+    fb->sparecount = 0;
+    return fb;
+}
+
+static fbuf_chunk_t * fbuf_new_chunk(fbuf_t *fb)
+{
+    fbuf_chunk_t *chunk;
+
+    if (fb->spare) {
+        chunk = fb->spare;
+        fb->spare = chunk->next;
+        fb->sparecount--;
+    }
+    else
+        chunk = malloc(sizeof(fbuf_chunk_t));
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+/* Removes all chunks from the memory part */
+static void fbuf_release_chunks(fbuf_t *fb)
+{
+    fbuf_chunk_t *chunk, *next;
+
+    for (chunk = fb->first; chunk; chunk = next) {
+        next = chunk->next;
+        if (fb->sparecount < FBUF_MAX_SPARE_CHUNKS) {
+            chunk->next = fb->spare;
+            fb->spare = chunk;
+            fb->sparecount++;
+        }
+        else
+            free(chunk);
+    }
+    fb->first = fb->last = NULL;
+    fb->memlen = 0;
+}
+
+void free_fbuf(fbuf_t *fb)
+{
+    fbuf_chunk_t *chunk, *next;
+
+    if (fb->fd >= 0)
+        close(fb->fd);
+    fb->sparecount = FBUF_MAX_SPARE_CHUNKS;
+    fbuf_release_chunks(fb);
+    for (chunk = fb->spare; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(fb);
+}
+
+void fbufclear(fbuf_t *fb)
+{
+    /* Do not reuse the file, data sent with sendfile() into a pipe can still
+       refer to its pages */
+    if (fb->fd >= 0) {
+        close(fb->fd);
+        fb->fd = -1;
+    }
+    fb->filelen = 0;
+    fbuf_release_chunks(fb);
+}
+
+size_t fbuflen(const fbuf_t *fb)
+{
+    return fb->filelen + fb->memlen;
+}
+
+void fbufwrite(fbuf_t *fb, const char *data, size_t len)
+{
+    fbuf_chunk_t *chunk;
+    size_t n;
+
+    while (len) {
+        chunk = fb->last;
+        if (!chunk || chunk->len == FBUF_CHUNK_SIZE) {
+            chunk = fbuf_new_chunk(fb);
+            if (fb->last)
+                fb->last->next = chunk;
+            else
+                fb->first = chunk;
+            fb->last = chunk;
+        }
+
+        n = FBUF_CHUNK_SIZE - chunk->len;
+        if (n > len)
+            n = len;
+        if (fb->memlimit && fb->memlen + n > fb->memlimit && fb->memlimit > fb->memlen)
+            n = fb->memlimit - fb->memlen;
+
+        memcpy(&chunk->data[chunk->len], data, n);
+        chunk->len += n;
+        fb->memlen += n;
+        data += n;
+        len -= n;
+
+        /* Move the memory part into the file when it is full, if this is
+           not possible keep everything in memory */
+        if (fb->memlimit && fb->memlen >= fb->memlimit && !fbufflush(fb))
+            fb->memlimit = 0;
+    }
+}
+
+void fbufprintf(fbuf_t *fb, const char *format, ...)
+{
+    va_list ap;
+    char *str;
+    int len;
+
+    va_start(ap, format);
+    len = vasprintf(&str, format, ap);
+    va_end(ap);
+
+    if (len < 0)
+        return;
+    fbufwrite(fb, str, len);
+    free(str);
+}
+
+/* Insert 'str' into the memory part, by splitting the chunk which contains
+   'offset' and linking in new chunks */
+static void fbuf_mem_insert(fbuf_t *fb, size_t offset, const char *str)
+{
+    fbuf_chunk_t *chunk, *tail = NULL, *next;
+    fbuf_t ins;
+    size_t len = strlen(str);
+
+    for (chunk = fb->first; chunk && offset > chunk->len; chunk = chunk->next)
+        offset -= chunk->len;
+
+    if (!chunk) {
+        fbufwrite(fb, str, len);
+        return;
+    }
+
+    /* Build the chunks for the inserted data, using the spare chunks */
+    ins.first = ins.last = NULL;
+    ins.memlen = 0;
+    ins.memlimit = 0;
+    ins.spare = fb->spare;
+    ins.sparecount = fb->sparecount;
+    fbufwrite(&ins, str, len);
+    if (offset < chunk->len) {
+        tail = fbuf_new_chunk(&ins);
+        tail->len = chunk->len - offset;
+        memcpy(tail->data, &chunk->data[offset], tail->len);
+        chunk->len = offset;
+        ins.last->next = tail;
+        ins.last = tail;
+    }
+    fb->spare = ins.spare;
+    fb->sparecount = ins.sparecount;
+
+    next = chunk->next;
+    chunk->next = ins.first;
+    ins.last->next = next;
+    if (fb->last == chunk)
+        fb->last = ins.last;
+    fb->memlen += len;
+}
+
+int fbufinsert(fbuf_t *fb, size_t offset, const char *str)
+{
+    char buf[65536];
+    size_t len = strlen(str);
+    size_t pos, n;
+
+    if (!len)
+        return 1;
+
+    if (offset >= fb->filelen) {
+        fbuf_mem_insert(fb, offset - fb->filelen, str);
+        return 1;
+    }
+
+    /* Make room in the file by moving the data behind 'offset', starting
+       at the end */
+    pos = fb->filelen;
+    while (pos > offset) {
+        n = pos - offset < sizeof(buf) ? pos - offset : sizeof(buf);
+        pos -= n;
+        if (pread(fb->fd, buf, n, pos) != (ssize_t)n ||
+                pwrite(fb->fd, buf, n, pos + len) != (ssize_t)n) {
+            _log("Could not move data in temporary file: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+    if (pwrite(fb->fd, str, len, offset) != (ssize_t)len) {
+        _log("Could not write to temporary file: %s\n", strerror(errno));
+        return 0;
+    }
+    fb->filelen += len;
+    return 1;
+}
+
+/* Fill 'iov' with the chunks starting at '*chunk' and advance '*chunk' to
+   the first chunk not used, returns the number of entries used */
+static int fbuf_iovec(const fbuf_chunk_t **chunk, struct iovec *iov, int max)
+{
+    int cnt = 0;
+
+    for (; *chunk && cnt < max; *chunk = (*chunk)->next) {
+        if (!(*chunk)->len)
+            continue;
+        iov[cnt].iov_base = (void *)(*chunk)->data;
+        iov[cnt].iov_len = (*chunk)->len;
+        cnt++;
+    }
+    return cnt;
+}
+
+int fbufflush(fbuf_t *fb)
+{
+    struct iovec iov[FBUF_IOVEC_MAX];
+    const fbuf_chunk_t *chunk = fb->first;
+    size_t len = 0;
+    ssize_t n;
+    int i, cnt;
+
+    if (!fb->memlen)
+        return 1;
+
+    if (fb->fd < 0 && (fb->fd = create_anon_file()) < 0)
+        return 0;
+
+    while ((cnt = fbuf_iovec(&chunk, iov, FBUF_IOVEC_MAX))) {
+        for (i = 0, n = 0; i < cnt; i++)
+            n += iov[i].iov_len;
+        if (pwritev(fb->fd, iov, cnt, fb->filelen + len) != n) {
+            _log("Could not write to temporary file: %s\n", strerror(errno));
+            return 0;
+        }
+        len += n;
+    }
+
+    fb->filelen += len;
+    fbuf_release_chunks(fb);
+    return 1;
+}
+
+/* Like write_all(), for a vector of buffers, 'iov' gets modified */
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt) {
+        if ((n = writev(fd, iov, cnt)) < 0) {
+            if (errno == EINTR || (errno == EAGAIN && pump_wait(fd, POLLOUT)))
+                continue;
+            return 0;
+        }
+        while (cnt && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+int fbufsend(const fbuf_t *fb, int fd)
+{
+    return fbufsendfrom(fb, 0, fd);
+}
+
+int fbufsendfrom(const fbuf_t *fb, size_t offset, int fd)
+{
+    struct iovec iov[FBUF_IOVEC_MAX];
+    const fbuf_chunk_t *chunk = fb->first;
+    int cnt;
+
+    if (offset < fb->filelen) {
+        if (!copy_fd_range(fd, fb->fd, offset, fb->filelen - offset))
+            return 0;
+        offset = 0;
+    }
+    else
+        offset -= fb->filelen;
+
+    while (chunk && offset >= chunk->len) {
+        offset -= chunk->len;
+        chunk = chunk->next;
+    }
+    if (chunk && offset) {
+        if (!write_all(fd, &chunk->data[offset], chunk->len - offset))
+            return 0;
+        chunk = chunk->next;
+    }
+
+    while ((cnt = fbuf_iovec(&chunk, iov, FBUF_IOVEC_MAX))) {
+        if (!writev_all(fd, iov, cnt))
+            return 0;
+    }
+    return 1;
+}
+
+int fbufread(const fbuf_t *fb, dstr_t *ds)
+{
+    const fbuf_chunk_t *chunk;
+    size_t len = ds->len;
+
+    if (fb->filelen) {
+        dstrassure(ds, len + fb->filelen + 1);
+        if (pread(fb->fd, &ds->data[len], fb->filelen, 0) != (ssize_t)fb->filelen) {
+            ds->data[len] = '\0';
+            return 0;
+        }
+        ds->len += fb->filelen;
+        ds->data[ds->len] = '\0';
+    }
+    for (chunk = fb->first; chunk; chunk = chunk->next)
+        dstrncat(ds, chunk->data, chunk->len);
+    return 1;
+}
+
 /*
  *  LIST
  */
@@ -1096,26 +1779,3 @@ int arglist_remove_flag(list_t *list, const char *name)
     return 0;
 }
 
-int copy_file(FILE *dest,
-              FILE *src,
-              const char *alreadyread,
-              size_t alreadyread_len)
-{
-    char buf[8192];
-    size_t bytes;
-
-    if (alreadyread && alreadyread_len)
-    {
-        if (fwrite(alreadyread, 1, alreadyread_len, dest) < alreadyread_len)
-        {
-            _log("Could not write to temp file\n");
-            return 0;
-        }
-    }
-
-    while ((bytes = fread(buf, 1, 8192, src)))
-        fwrite(buf, 1, bytes, dest);
-
-    return !ferror(src) && !ferror(dest);
-}
-
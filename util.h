@@ -31,6 +31,7 @@
 #include "config.h"
 #include <string.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 
 extern const char* shellescapes;
@@ -122,6 +123,7 @@ void extract_command(size_t *start, size_t *end, const char *cmdline, const char
 
 char ** argv_split(const char *string, const char *separators, int *cntp);
 size_t argv_count(char **argv);
+char ** argv_copy(char **argv);
 void argv_free(char **argv);
 
 /*
@@ -129,8 +131,6 @@ void argv_free(char **argv);
  */
 int contains_command(const char *cmdline, const char *cmd);
 
-int copy_file(FILE *dest, FILE *src, const char *alreadyread, size_t alreadyread_len);
-
 /* Dynamic string */
 typedef struct dstr {
     char *data;
@@ -144,7 +144,7 @@ void dstrclear(dstr_t *ds);
 void dstrassure(dstr_t *ds, size_t alloc);
 void dstrcpy(dstr_t *ds, const char *src);
 void dstrncpy(dstr_t *ds, const char *src, size_t n);
-void dstrncat(dstr_t *ds, const char *src, size_t n);
+void dstrncat(dstr_t *ds, const char *src, size_t n); /* appends exactly n bytes, binary safe */
 void dstrcpyf(dstr_t *ds, const char *src, ...);
 void dstrcat(dstr_t *ds, const char *src);
 void dstrcatf(dstr_t *ds, const char *src, ...);
@@ -164,6 +164,105 @@ void dstrtrim(dstr_t *ds);
 void dstrtrim_right(dstr_t *ds);
 
 
+/* read() which keeps the pumps (pump.h) going while it waits for data */
+ssize_t read_some(int fd, char *buf, size_t len);
+
+/* write() all of 'data', 0 on error. A full non-blocking pipe is waited
+   for, with the pumps going. */
+int write_all(int fd, const char *data, size_t len);
+
+/* Anonymous temporary file (memfd if available, otherwise an unnamed file
+   in temp_dir()), closed on exec, -1 on error */
+int create_anon_file();
+
+/* Anonymous temporary file for 'size' bytes, in memory only if they do not
+   exceed temp_memory_limit */
+int create_temp_file(size_t size);
+
+/* Copy 'alreadyread' and everything from 'infd' up to EOF into an anonymous
+   temporary file, which moves from memory to disk when the data exceeds
+   temp_memory_limit. Returns the file, positioned at the start, or -1. */
+int spool_to_temp_file(int infd, const char *alreadyread, size_t len);
+
+/* Spill file: a buffer for data which is written once and read after that,
+   also by different processes. The data is kept in memory up to
+   temp_memory_limit bytes and moves into an unnamed file on disk beyond
+   that. Both files are created with create_spillfile(), before the writing
+   process gets started, spillfinish() returns the one with the data. */
+typedef struct spillfile {
+    int memfd;
+    int diskfd;
+    size_t size;            /* bytes written by this process */
+    int ondisk;
+} spillfile_t;
+
+int create_spillfile(spillfile_t *sf); /* returns 0 on error */
+void close_spillfile(spillfile_t *sf);
+int spillwrite(spillfile_t *sf, const char *data, size_t len); /* returns 0 on error */
+int spillfromfd(spillfile_t *sf, int fd); /* everything up to EOF, returns 0 on error */
+void spillclear(spillfile_t *sf);
+FILE * spillfopen(spillfile_t *sf); /* stream which writes with spillwrite() */
+int spillfinish(spillfile_t *sf); /* the file with the data, at its start, the other one is closed */
+
+/* "/dev/fd/<fd>" in 'path' (PATH_MAX bytes), for naming 'fd' on the command
+   line of a child process. 'fd' stays close-on-exec, see inherit_fd_paths() */
+const char * fd_path(int fd, char *path);
+
+/* Returns the next descriptor above 2 which '*str' names as "/dev/fd/<fd>"
+   and moves '*str' behind it, -1 if there is none */
+int next_fd_path(const char **str);
+
+/* Clears (inherit != 0) or sets FD_CLOEXEC on the descriptors named in 'str',
+   so that only the child which needs them gets them */
+void inherit_fd_paths(const char *str, int inherit);
+
+/* Copy 'count' bytes at 'offset' of the file 'infd' to 'outfd', with
+   sendfile() if possible. Returns 0 on error. */
+int copy_fd_range(int outfd, int infd, off_t offset, size_t count);
+
+/* Copy everything from 'infd' up to EOF to 'outfd', with splice() or
+   sendfile() if possible. Returns 0 on error. */
+int copy_fd(int outfd, int infd);
+
+/* File buffer: data which gets sent out several times (like the PostScript
+   header on every start of the renderer) is kept in an anonymous file and
+   copied into the pipes by the kernel. Appended data goes into a list of
+   fixed-size chunks first, so it never gets copied by a realloc(), and is
+   written out with writev(). fbufflush() moves it to the end of the file.
+   This also happens as soon as the chunks hold more than 'memlimit' bytes
+   (if it is not 0), so that the memory used by the buffer stays bounded. */
+#define FBUF_CHUNK_SIZE 65536
+#define FBUF_IOVEC_MAX 64
+
+typedef struct fbuf_chunk {
+    struct fbuf_chunk *next;
+    size_t len;
+    char data[FBUF_CHUNK_SIZE];
+} fbuf_chunk_t;
+
+typedef struct fbuf {
+    int fd;
+    size_t filelen;
+    fbuf_chunk_t *first, *last;
+    size_t memlen;
+    size_t memlimit;
+    fbuf_chunk_t *spare;
+    int sparecount;
+} fbuf_t;
+
+fbuf_t * create_fbuf();
+void free_fbuf(fbuf_t *fb);
+void fbufclear(fbuf_t *fb);
+size_t fbuflen(const fbuf_t *fb);
+void fbufwrite(fbuf_t *fb, const char *data, size_t len);
+void fbufprintf(fbuf_t *fb, const char *format, ...);
+int fbufinsert(fbuf_t *fb, size_t offset, const char *str);
+int fbufflush(fbuf_t *fb);
+int fbufsend(const fbuf_t *fb, int fd); /* returns 0 on error */
+int fbufsendfrom(const fbuf_t *fb, size_t offset, int fd); /* only the data from 'offset' on */
+int fbufread(const fbuf_t *fb, dstr_t *ds); /* appends the whole contents to ds */
+
+
 /* Doubly linked list of void pointers */
 typedef struct listitem_s {
     void *data;